@@ -0,0 +1,123 @@
+/* Micro-benchmark of the inverse-CDF samplers of sampler.c.
+ *   usage: ./bench_sampler [ndraw (default 10000000)]
+ * Draws x from tables shaped like those of genstars, the IMF in log mass (1001 nodes), the density along a line of
+ * sight toward the bulge (16001 nodes), and P(fg) of a Shu DF node (60 nodes), by
+ *   getcumu2xist() from the 5-percentile hint, as genstars did before,
+ *   cdftab_draw() with the guide table of 4n buckets and precomputed quadratics, and
+ *   cdf_draw() with the guide table alone, as for the Shu DF nodes,
+ * and prints the time per draw and the largest difference from getcumu2xist(). */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include "sampler.h"
+
+//----------------
+double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+//----------------
+void make_cumu(int n, const double *x, double *f, double *F)
+/* Normalized cumulative F of f by the trapezoid rule, with f normalized as well */
+{
+  F[0] = 0;
+  for (int i=1; i<n; i++) F[i] = F[i-1] + 0.5*(f[i-1] + f[i])*(x[i] - x[i-1]);
+  double norm = F[n-1];
+  for (int i=0; i<n; i++) F[i] /= norm, f[i] /= norm;
+}
+//----------------
+void bench(const char *name, int n, double *x, double *F, double *f, int ndraw, const double *us)
+{
+  // 5-percentile hints as genstars made them
+  int ptiles[22] = {};
+  for (int i=0; i<n; i++){
+    int intp = F[i]*20;
+    if (ptiles[intp] == 0) ptiles[intp] = (intp==0) ? 1 : i;
+  }
+  double *x1 = (double *)malloc(sizeof(double) * ndraw);
+  double *x2 = (double *)malloc(sizeof(double) * ndraw);
+  double *x3 = (double *)malloc(sizeof(double) * ndraw);
+  double t0 = now();
+  for (int j=0; j<ndraw; j++){
+    int kst = 1;
+    for (int itmp = us[j]*20; itmp > 0; itmp--){
+      kst = ptiles[itmp];
+      if (kst > 0) break;
+    }
+    x1[j] = getcumu2xist(n, x, F, f, us[j], kst, 0);
+  }
+  double t1 = now();
+  cdftab t;
+  cdftab_init(&t, n, x, F, f, 4*n);
+  double t2 = now();
+  for (int j=0; j<ndraw; j++) x2[j] = cdftab_draw(&t, us[j]);
+  double t3 = now();
+  int nguide = 64, *guide = (int *)malloc(sizeof(int) * nguide);
+  cdf_guide_build(n, F, nguide, guide);
+  double t4 = now();
+  for (int j=0; j<ndraw; j++) x3[j] = cdf_draw(n, x, F, f, nguide, guide, us[j]);
+  double t5 = now();
+  double d2 = 0, d3 = 0;
+  for (int j=0; j<ndraw; j++){
+    if (fabs(x2[j] - x1[j]) > d2) d2 = fabs(x2[j] - x1[j]);
+    if (fabs(x3[j] - x1[j]) > d3) d3 = fabs(x3[j] - x1[j]);
+  }
+  printf("%-14s n= %5d  getcumu2xist %7.2f ns  cdftab_draw %6.2f ns (build %6.3f ms, max diff %.1e)  cdf_draw(64) %6.2f ns (max diff %.1e)\n",
+         name, n, 1e9*(t1-t0)/ndraw, 1e9*(t3-t2)/ndraw, 1e3*(t2-t1), d2, 1e9*(t5-t4)/ndraw, d3);
+  cdftab_free(&t);
+  free(guide);
+  free(x1), free(x2), free(x3);
+}
+//----------------
+int main(int argc, char **argv)
+{
+  int ndraw = (argc > 1) ? atoi(argv[1]) : 10000000;
+  if (ndraw < 1){
+    printf("usage: %s [ndraw]\n", argv[0]);
+    exit(1);
+  }
+  double *us = (double *)malloc(sizeof(double) * ndraw);
+  uint64_t s = 88172645463325252ULL; // xorshift64
+  for (int j=0; j<ndraw; j++){
+    s ^= s << 13, s ^= s >> 7, s ^= s << 17;
+    us[j] = ((s >> 11) + 0.5) * 0x1p-53;
+  }
+  int nmax = 16001;
+  double *x = (double *)malloc(sizeof(double) * nmax);
+  double *f = (double *)malloc(sizeof(double) * nmax);
+  double *F = (double *)malloc(sizeof(double) * nmax);
+  // IMF per log mass from 0.001 to 120 Msun, broken power law with slopes -0.3, -1.3, -2.3 at 0.08 and 0.5 Msun
+  int n = 1001;
+  for (int i=0; i<n; i++){
+    x[i] = -3 + (log10(120.0) + 3) * i / (n-1);
+    double M = pow(10, x[i]);
+    f[i] = (M < 0.08) ? pow(M/0.08, 0.7) : (M < 0.5) ? pow(M/0.08, -0.3) : pow(0.5/0.08, -0.3) * pow(M/0.5, -1.3);
+  }
+  make_cumu(n, x, f, F);
+  bench("IMF", n, x, F, f, ndraw, us);
+  // Stars per distance bin toward the bulge, D^2 times a disk and a bar peaking at 8200 pc
+  n = 16001;
+  for (int i=0; i<n; i++){
+    x[i] = i;
+    double D = x[i];
+    f[i] = D*D * (exp(-D/3000) + 50*exp(-0.5*pow((D-8200)/600, 2)));
+  }
+  make_cumu(n, x, f, F);
+  bench("distance", n, x, F, f, ndraw, us);
+  // P(fg) of a Shu DF node, a skewed peak on unequal steps of fg
+  n = 60;
+  double fg = 0.3;
+  for (int i=0; i<n; i++){
+    x[i] = fg;
+    f[i] = exp(-0.5*pow((fg-1.0)/0.15, 2)) * (1 + 0.5*(fg-1.0));
+    fg += (fabs(fg-1.0) < 0.2) ? 0.01 : 0.03;
+  }
+  make_cumu(n, x, f, F);
+  bench("Shu P(fg)", n, x, F, f, ndraw, us);
+  free(x), free(f), free(F), free(us);
+  return 0;
+}
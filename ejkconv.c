@@ -0,0 +1,36 @@
+/* Convert the text E(J-Ks) map used by genstars into its binary or compressed version (see ejkmap.h).
+ *   usage: ./ejkconv input_files/EJK_G12_S20_LR.dat [output]
+ * The output is input_files/EJK_G12_S20_LR.bin by default, which genstars mmap-s
+ * instead of parsing the text file every run.
+ * When the output name ends with .ejz, e.g. input_files/EJK_G12_S20_LR.ejz, the block-compressed
+ * version is written instead, which is small enough to be distributed in place of the text file.
+ * Values are copied as they are parsed by genstars from the text, so results do not change. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ejkmap.h"
+
+int main(int argc,char **argv)
+{
+  if (argc < 2){
+    printf("usage: %s input_files/EJK_G12_S20_LR.dat [output(.bin or .ejz)]\n",argv[0]);
+    exit(1);
+  }
+  char outfile[1000];
+  if (argc > 2) snprintf(outfile, sizeof(outfile), "%s", argv[2]);
+  else ejkmap_sidename(argv[1], ".bin", outfile, sizeof(outfile));
+  size_t n = strlen(outfile);
+  int ejz = (n > 4 && strcmp(outfile + n - 4, ".ejz") == 0);
+  ejkmap *m = ejkmap_read_text(argv[1]);
+  if (m == NULL){
+    printf("can't open %s\n",argv[1]);
+    exit(1);
+  }
+  if ((ejz ? ejkmap_write_ejz(m, outfile) : ejkmap_write_bin(m, outfile)) != 0){
+    printf("can't write %s\n",outfile);
+    exit(1);
+  }
+  printf("%s -> %s: %d x %d grids, %ld grids with %d subgrids\n",argv[1],outfile,m->nl,m->nb,m->nsubrow,m->nsub);
+  ejkmap_close(m);
+  return 0;
+}
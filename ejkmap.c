@@ -0,0 +1,724 @@
+/* Read the E(J-Ks) extinction map from the text file or its binary version (see ejkmap.h). */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "option.h"
+#include "ejkmap.h"
+#include "shmtab.h"
+
+//----------------
+void ejkmap_sidename(const char *fileEJK, const char *ext, char *sidefile, size_t n)
+{
+  // input_files/EJK_G12_S20_LR.dat -> input_files/EJK_G12_S20_LR.bin (ext = ".bin")
+  snprintf(sidefile, n, "%s", fileEJK);
+  char *dot = strrchr(sidefile, '.');
+  if (dot != NULL && strchr(dot, '/') == NULL) *dot = '\0';
+  if (strlen(sidefile) + strlen(ext) < n) strcat(sidefile, ext);
+}
+//----------------
+static ejkmap *ejkmap_from_image(const void *map, size_t size, const char *name)
+/* Access the map in the binary layout at map (a mmap-ed file or shared memory) */
+{
+  const ejkbin_header *h = (const ejkbin_header *) map;
+  long ngrid = (long) h->nl * h->nb;
+  if (size < sizeof(ejkbin_header) || memcmp(h->magic, EJKBIN_MAGIC, 8) != 0 || h->version != EJKBIN_VERSION
+      || h->nsub < 0 || h->nsub > EJK_NSUBMAX
+      || h->off_sub + (int64_t) sizeof(double) * h->nsubrow * h->nsub > (int64_t) size
+      || h->off_isub + (int64_t) sizeof(int32_t) * ngrid > (int64_t) size
+      || h->off_mean + (int64_t) sizeof(double) * ngrid > (int64_t) size){
+    printf("# %s is not a valid binary E(J-Ks) map, ignored.\n", name);
+    return NULL;
+  }
+  ejkmap *m = calloc(1, sizeof(ejkmap));
+  m->nl = h->nl, m->nb = h->nb, m->nsub = h->nsub, m->nsubrow = h->nsubrow;
+  m->l0e4 = h->l0e4, m->b0e4 = h->b0e4, m->dle4 = h->dle4, m->dbe4 = h->dbe4;
+  m->mean = (const double  *) ((const char *) map + h->off_mean);
+  m->isub = (const int32_t *) ((const char *) map + h->off_isub);
+  m->sub  = (const double  *) ((const char *) map + h->off_sub);
+  return m;
+}
+//----------------
+static ejkmap *ejkmap_map_bin(const char *binfile)
+{
+  int fd = open(binfile, O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(ejkbin_header)){
+    close(fd);
+    return NULL;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return NULL;
+  ejkmap *m = ejkmap_from_image(map, st.st_size, binfile);
+  if (m == NULL){
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  m->map = map;
+  m->mapsize = st.st_size;
+  return m;
+}
+//----------------
+static ejkmap *ejkmap_new_text(void)
+{
+  ejkmap *m = calloc(1, sizeof(ejkmap));
+  m->nl = EJK_NL, m->nb = EJK_NB;
+  m->l0e4 = EJK_L0E4, m->b0e4 = EJK_B0E4, m->dle4 = m->dbe4 = EJK_DE4;
+  long ngrid = (long) m->nl * m->nb;
+  m->mean_buf = calloc(ngrid, sizeof(double));
+  m->isub_buf = malloc(sizeof(int32_t) * ngrid);
+  for (long i=0; i<ngrid; i++) m->isub_buf[i] = -1;
+  m->mean = m->mean_buf;
+  m->isub = m->isub_buf;
+  return m;
+}
+//----------------
+static double *ejkmap_add_subrow(ejkmap *m, long igrid, long *nalloc)
+/* Return the place for the subgrid values of grid igrid */
+{
+  if (m->nsubrow == *nalloc){
+    *nalloc = (*nalloc == 0) ? 4096 : 2 * *nalloc;
+    m->sub_buf = realloc(m->sub_buf, sizeof(double) * *nalloc * m->nsub);
+    m->sub = m->sub_buf;
+  }
+  m->isub_buf[igrid] = m->nsubrow;
+  return m->sub_buf + m->nsubrow++ * m->nsub;
+}
+//----------------
+static long ejkmap_store_line(ejkmap *m, char *line, const char *fileEJK, long *nalloc)
+/* Store values in a line of the text map. Return the grid index or -1 for a comment line. */
+{
+  char *words[EJK_NSUBMAX+5];
+  int nwords = tokenize(line, words, EJK_NSUBMAX+5);
+  if (nwords < 3 || *words[0] == '#') return -1;
+  int il = lround((1e+4*parse_double(words[0]) - m->l0e4)/m->dle4);
+  int ib = lround((1e+4*parse_double(words[1]) - m->b0e4)/m->dbe4);
+  if (il < 0 || il >= m->nl || ib < 0 || ib >= m->nb){
+    printf("%s: (l, b)= (%s, %s) is outside the map grid!\n",fileEJK,words[0],words[1]);
+    exit(1);
+  }
+  long igrid = (long) il * m->nb + ib;
+  m->mean_buf[igrid] = parse_double(words[2]);
+  if (nwords <= 4) return igrid; // no subgrid
+  if (m->nsub == 0) m->nsub = nwords - 3;
+  if (nwords - 3 != m->nsub){
+    printf("%s: %d subgrids at (l, b)= (%s, %s) while %d elsewhere!\n",fileEJK,nwords-3,words[0],words[1],m->nsub);
+    exit(1);
+  }
+  double *sub = ejkmap_add_subrow(m, igrid, nalloc);
+  for (int k=0; k<m->nsub; k++){
+    sub[k] = parse_double(words[k+3]);
+  }
+  return igrid;
+}
+//----------------
+ejkmap *ejkmap_read_text(const char *fileEJK)
+{
+  FILE *fp;
+  char line[1000];
+  if((fp=fopen(fileEJK,"r"))==NULL) return NULL;
+  ejkmap *m = ejkmap_new_text();
+  long nalloc = 0;
+  while (fgets(line,1000,fp) !=NULL){
+    ejkmap_store_line(m, line, fileEJK, &nalloc);
+  }
+  fclose(fp);
+  return m;
+}
+//----------------
+static int64_t *ejkmap_index(const char *fileEJK, FILE *fp, void **idxmap, size_t *idxsize)
+/* Return the byte offset of the line of every grid in fileEJK.
+ * The sidecar index is mmap-ed when it matches fileEJK, otherwise it is made by scanning fileEJK
+ * and saved for later runs (kept only in memory if it cannot be written). */
+{
+  char idxfile[1000], line[1000];
+  struct stat st;
+  long ngrid = (long) EJK_NL * EJK_NB;
+  size_t size = sizeof(ejkidx_header) + sizeof(int64_t) * ngrid;
+  *idxmap = NULL;
+  *idxsize = 0;
+  if (fstat(fileno(fp), &st) != 0) return NULL;
+  ejkmap_sidename(fileEJK, ".idx", idxfile, sizeof(idxfile));
+  int fd = open(idxfile, O_RDONLY);
+  if (fd >= 0){
+    struct stat sti;
+    if (fstat(fd, &sti) == 0 && sti.st_size == (off_t) size){
+      void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+      const ejkidx_header *h = (const ejkidx_header *) map;
+      if (map != MAP_FAILED && memcmp(h->magic, EJKIDX_MAGIC, 8) == 0 && h->version == EJKIDX_VERSION
+          && h->nl == EJK_NL && h->nb == EJK_NB && h->txtsize == st.st_size && h->txtmtime == st.st_mtime){
+        close(fd);
+        *idxmap = map;
+        *idxsize = size;
+        return (int64_t *) ((char *) map + sizeof(ejkidx_header));
+      }
+      if (map != MAP_FAILED) munmap(map, size);
+    }
+    close(fd);
+  }
+  // Make the index by scanning fileEJK once
+  ejkidx_header *h = calloc(1, size);
+  memcpy(h->magic, EJKIDX_MAGIC, 8);
+  h->version = EJKIDX_VERSION;
+  h->nl = EJK_NL, h->nb = EJK_NB;
+  h->txtsize = st.st_size, h->txtmtime = st.st_mtime;
+  int64_t *offsets = (int64_t *) ((char *) h + sizeof(ejkidx_header));
+  for (long i=0; i<ngrid; i++) offsets[i] = -1;
+  rewind(fp);
+  int64_t offset = 0;
+  while (fgets(line,1000,fp) !=NULL){
+    char *words[2];
+    if (tokenize(line, words, 2) == 2 && *words[0] != '#'){
+      int il = lround((1e+4*parse_double(words[0]) - EJK_L0E4)/EJK_DE4);
+      int ib = lround((1e+4*parse_double(words[1]) - EJK_B0E4)/EJK_DE4);
+      if (il >= 0 && il < EJK_NL && ib >= 0 && ib < EJK_NB) offsets[(long) il * EJK_NB + ib] = offset;
+    }
+    offset = ftello(fp);
+  }
+  // Written to a file of this process and renamed over idxfile, so that processes mapping idxfile at the same time
+  // see either a complete old index or the complete new one, never a truncated file
+  char tmpfile[1100];
+  FILE *fpi;
+  snprintf(tmpfile, sizeof(tmpfile), "%s.%ld", idxfile, (long) getpid());
+  if ((fpi=fopen(tmpfile,"wb")) != NULL){
+    int nerr = fwrite(h, size, 1, fpi) != 1;
+    nerr += fclose(fpi) != 0;
+    if (nerr == 0) nerr += rename(tmpfile, idxfile) != 0;
+    if (nerr > 0) remove(tmpfile);
+  }
+  *idxmap = h;
+  return offsets;
+}
+//----------------
+ejkmap *ejkmap_read_text_range(const char *fileEJK, double lst, double len, double bst, double ben)
+/* Read only the lines of grids that can overlap with lst < l < len, bst < b < ben.
+ * Lines of a column of grids with the same l are contiguous, so each column costs a seek. */
+{
+  FILE *fp;
+  char line[1000];
+  if((fp=fopen(fileEJK,"r"))==NULL) return NULL;
+  void *idxmap;
+  size_t idxsize;
+  int64_t *offsets = ejkmap_index(fileEJK, fp, &idxmap, &idxsize);
+  if (offsets == NULL){
+    fclose(fp);
+    return ejkmap_read_text(fileEJK);
+  }
+  ejkmap *m = ejkmap_new_text();
+  long nalloc = 0;
+  int ilst, ilen, ibst, iben;
+  ejkmap_range(m, lst, len, bst, ben, &ilst, &ilen, &ibst, &iben);
+  for (int il = ilst; il <= ilen; il++){
+    long ib = ibst;
+    while (ib <= iben){
+      int64_t offset = offsets[(long) il * m->nb + ib];
+      if (offset < 0){
+        ib++;
+        continue;
+      }
+      fseeko(fp, offset, SEEK_SET);
+      while (ib <= iben && fgets(line,1000,fp) != NULL){
+        long igrid = ejkmap_store_line(m, line, fileEJK, &nalloc);
+        if (igrid < 0) continue;
+        if (igrid / m->nb != il) break; // end of the column
+        ib = igrid % m->nb + 1;
+      }
+      if (feof(fp)) break;
+    }
+  }
+  fclose(fp);
+  if (idxsize > 0) munmap(idxmap, idxsize);
+  else free(idxmap);
+  return m;
+}
+//----------------
+static const double pow10s[23] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+static int ejkz_ndec(double x, int64_t *k)
+/* Find the fewest decimals d such that x is exactly the double nearest to k/10^d, i.e. atof() of the
+ * decimal text of x. Return d, or EJKZ_RAW when there is no such d <= EJKZ_DECMAX. */
+{
+  for (int d=0; d<=EJKZ_DECMAX; d++){
+    double kd = nearbyint(x * pow10s[d]);
+    if (fabs(kd) >= 9007199254740992.0) break; // 2^53
+    double y = kd / pow10s[d];
+    if (memcmp(&x, &y, sizeof(double)) == 0){
+      *k = (int64_t) kd;
+      return d;
+    }
+  }
+  return EJKZ_RAW;
+}
+static int64_t ejkz_round(double x)
+{
+  return (fabs(x) < 9007199254740992.0) ? (int64_t) nearbyint(x) : 0;
+}
+static unsigned char *ejkz_put(unsigned char *p, int64_t v) // zigzag varint
+{
+  uint64_t u = ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+  while (u >= 0x80){
+    *p++ = (u & 0x7f) | 0x80;
+    u >>= 7;
+  }
+  *p++ = u;
+  return p;
+}
+static const unsigned char *ejkz_get(const unsigned char *p, const unsigned char *end, int64_t *v)
+{
+  uint64_t u = 0;
+  for (int shift=0; p < end && shift < 64; shift+=7){
+    u |= (uint64_t) (*p & 0x7f) << shift;
+    if ((*p++ & 0x80) == 0){
+      *v = (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+      return p;
+    }
+  }
+  return NULL;
+}
+static unsigned char *ejkz_put_raw(unsigned char *p, double x)
+{
+  memcpy(p, &x, sizeof(double));
+  return p + sizeof(double);
+}
+//----------------
+static unsigned char *ejkz_encode_block(const ejkmap *m, int il0, int ib0, unsigned char *p)
+/* Encode the grids in a block into p. Return the end of the block. */
+{
+  int64_t kmean = 0;
+  int dmean = -1;
+  for (int il = il0; il < il0 + EJKZ_BLOCK && il < m->nl; il++){
+    for (int ib = ib0; ib < ib0 + EJKZ_BLOCK && ib < m->nb; ib++){
+      long igrid = (long) il * m->nb + ib;
+      int64_t k = 0;
+      int d = ejkz_ndec(m->mean[igrid], &k);
+      int hassub = (m->isub[igrid] >= 0);
+      *p++ = d | (hassub ? EJKZ_HASSUB : 0);
+      if (d == EJKZ_RAW) p = ejkz_put_raw(p, m->mean[igrid]);
+      else               p = ejkz_put(p, (d == dmean) ? k - kmean : k); // delta from the previous grid
+      kmean = k, dmean = d;
+      if (!hassub) continue;
+      // Subgrid values as integers at the finest decimal among them, delta from the previous one
+      const double *sub = m->sub + (long) m->isub[igrid] * m->nsub;
+      int64_t ks[EJK_NSUBMAX];
+      int dsub = 0;
+      for (int j=0; j<m->nsub && dsub != EJKZ_RAW; j++){
+        int dj = ejkz_ndec(sub[j], &ks[j]);
+        if (dj > dsub) dsub = dj;
+      }
+      for (int j=0; j<m->nsub && dsub != EJKZ_RAW; j++){
+        ks[j] = ejkz_round(sub[j] * pow10s[dsub]);
+        double y = (double) ks[j] / pow10s[dsub];
+        if (memcmp(&sub[j], &y, sizeof(double)) != 0) dsub = EJKZ_RAW;
+      }
+      *p++ = dsub;
+      int64_t kprev = (dsub == EJKZ_RAW) ? 0 : ejkz_round(m->mean[igrid] * pow10s[dsub]);
+      for (int j=0; j<m->nsub; j++){
+        if (dsub == EJKZ_RAW){
+          p = ejkz_put_raw(p, sub[j]);
+          continue;
+        }
+        p = ejkz_put(p, ks[j] - kprev);
+        kprev = ks[j];
+      }
+    }
+  }
+  return p;
+}
+//----------------
+int ejkmap_write_ejz(const ejkmap *m, const char *outfile)
+/* Write the map in the block-compressed format (see ejkmap.h) */
+{
+  FILE *fp;
+  if((fp=fopen(outfile,"wb"))==NULL) return -1;
+  ejkz_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, EJKZ_MAGIC, 8);
+  h.version = EJKZ_VERSION;
+  h.nl = m->nl, h.nb = m->nb, h.nsub = m->nsub, h.nsubrow = m->nsubrow;
+  h.l0e4 = m->l0e4, h.b0e4 = m->b0e4, h.dle4 = m->dle4, h.dbe4 = m->dbe4;
+  h.block = EJKZ_BLOCK;
+  h.nlblock = (m->nl + EJKZ_BLOCK - 1) / EJKZ_BLOCK;
+  h.nbblock = (m->nb + EJKZ_BLOCK - 1) / EJKZ_BLOCK;
+  long nblock = (long) h.nlblock * h.nbblock;
+  int64_t *offsets = malloc(sizeof(int64_t) * (nblock + 1));
+  // A block takes at most 1 + 10 bytes per mean and 1 + 10 bytes per subgrid value
+  unsigned char *buf = malloc((size_t) EJKZ_BLOCK * EJKZ_BLOCK * (2 + m->nsub) * 11);
+  int nerr = 0;
+  nerr += fwrite(&h, sizeof(h), 1, fp) != 1;
+  nerr += fwrite(offsets, sizeof(int64_t), nblock + 1, fp) != (size_t) (nblock + 1); // filled later
+  offsets[0] = sizeof(h) + sizeof(int64_t) * (nblock + 1);
+  for (long iblock = 0; iblock < nblock; iblock++){ // l-major
+    int il0 = (iblock / h.nbblock) * EJKZ_BLOCK;
+    int ib0 = (iblock % h.nbblock) * EJKZ_BLOCK;
+    unsigned char *end = ejkz_encode_block(m, il0, ib0, buf);
+    nerr += fwrite(buf, 1, end - buf, fp) != (size_t) (end - buf);
+    offsets[iblock+1] = offsets[iblock] + (end - buf);
+  }
+  nerr += fseek(fp, sizeof(h), SEEK_SET) != 0;
+  nerr += fwrite(offsets, sizeof(int64_t), nblock + 1, fp) != (size_t) (nblock + 1);
+  nerr += fclose(fp) != 0;
+  free(buf);
+  free(offsets);
+  return (nerr > 0) ? -1 : 0;
+}
+//----------------
+static int ejkz_decode_block(ejkmap *m, int il0, int ib0, const unsigned char *p, const unsigned char *end, long *nalloc, ejkz_tile *t)
+/* Decode a block encoded by ejkz_encode_block into the map, or into the tile t if not NULL.
+ * Return 0, or -1 for corrupted data. */
+{
+  int64_t kmean = 0, v;
+  int dmean = -1;
+  double *mean = (t != NULL) ? t->mean : m->mean_buf;
+  for (int il = il0; il < il0 + EJKZ_BLOCK && il < m->nl; il++){
+    for (int ib = ib0; ib < ib0 + EJKZ_BLOCK && ib < m->nb; ib++){
+      long igrid = (t != NULL) ? (long) (il - il0) * EJKZ_BLOCK + ib - ib0 : (long) il * m->nb + ib;
+      if (p >= end) return -1;
+      int hassub = (*p & EJKZ_HASSUB) != 0;
+      int d = *p++ & ~EJKZ_HASSUB;
+      if (d == EJKZ_RAW){
+        if (end - p < (long) sizeof(double)) return -1;
+        memcpy(&mean[igrid], p, sizeof(double));
+        p += sizeof(double);
+      }else{
+        if (d > EJKZ_DECMAX || (p = ejkz_get(p, end, &v)) == NULL) return -1;
+        kmean = (d == dmean) ? kmean + v : v;
+        mean[igrid] = (double) kmean / pow10s[d];
+      }
+      dmean = d;
+      if (!hassub) continue;
+      if (p >= end) return -1;
+      int dsub = *p++;
+      if (dsub != EJKZ_RAW && dsub > EJKZ_DECMAX) return -1;
+      double *sub;
+      if (t != NULL) sub = t->sub + (long) (t->isub[igrid] = igrid) * m->nsub;
+      else           sub = ejkmap_add_subrow(m, igrid, nalloc);
+      int64_t k = (dsub == EJKZ_RAW) ? 0 : ejkz_round(mean[igrid] * pow10s[dsub]);
+      for (int j=0; j<m->nsub; j++){
+        if (dsub == EJKZ_RAW){
+          if (end - p < (long) sizeof(double)) return -1;
+          memcpy(&sub[j], p, sizeof(double));
+          p += sizeof(double);
+          continue;
+        }
+        if ((p = ejkz_get(p, end, &v)) == NULL) return -1;
+        k += v;
+        sub[j] = (double) k / pow10s[dsub];
+      }
+    }
+  }
+  return 0;
+}
+//----------------
+static int ejkz_open(const char *zfile, ejkz_header *h, int64_t **offsets)
+/* Open the compressed map and read its header and block offsets.
+ * Return the file descriptor, or -1 when zfile does not exist or is not a valid map. */
+{
+  int fd = open(zfile, O_RDONLY);
+  if (fd < 0) return -1;
+  if (pread(fd, h, sizeof(ejkz_header), 0) != (ssize_t) sizeof(ejkz_header) || memcmp(h->magic, EJKZ_MAGIC, 8) != 0
+      || h->version != EJKZ_VERSION || h->nsub < 0 || h->nsub > EJK_NSUBMAX || h->block != EJKZ_BLOCK
+      || h->nlblock != (h->nl + EJKZ_BLOCK - 1) / EJKZ_BLOCK || h->nbblock != (h->nb + EJKZ_BLOCK - 1) / EJKZ_BLOCK){
+    printf("# %s is not a valid compressed E(J-Ks) map, ignored.\n", zfile);
+    close(fd);
+    return -1;
+  }
+  if (h->nl != EJK_NL || h->nb != EJK_NB){
+    printf("%s: %d x %d grids while %d x %d are expected!\n", zfile, h->nl, h->nb, EJK_NL, EJK_NB);
+    exit(1);
+  }
+  long nblock = (long) h->nlblock * h->nbblock;
+  size_t size = sizeof(int64_t) * (nblock + 1);
+  *offsets = malloc(size);
+  if (pread(fd, *offsets, size, sizeof(ejkz_header)) != (ssize_t) size){
+    printf("%s is truncated!\n", zfile);
+    exit(1);
+  }
+  return fd;
+}
+//----------------
+static const unsigned char *ejkz_read_block(int fd, const int64_t *offsets, long iblock, unsigned char **buf, size_t *nbuf, const char *zfile)
+/* Read block iblock into *buf. Return the end of the block. */
+{
+  size_t size = offsets[iblock+1] - offsets[iblock];
+  if (size > *nbuf) *buf = realloc(*buf, *nbuf = size);
+  if (pread(fd, *buf, size, offsets[iblock]) != (ssize_t) size){
+    printf("%s is truncated at block %ld!\n", zfile, iblock);
+    exit(1);
+  }
+  return *buf + size;
+}
+//----------------
+static void ejkz_set_geometry(ejkmap *m, const ejkz_header *h)
+{
+  m->nl = h->nl, m->nb = h->nb, m->nsub = h->nsub;
+  m->l0e4 = h->l0e4, m->b0e4 = h->b0e4, m->dle4 = h->dle4, m->dbe4 = h->dbe4;
+}
+//----------------
+ejkmap *ejkmap_read_ejz(const char *zfile, double lst, double len, double bst, double ben)
+/* Read the grids that can overlap with lst < l < len, bst < b < ben from the block-compressed map,
+ * decompressing only the blocks containing them */
+{
+  ejkz_header h;
+  int64_t *offsets;
+  int fd = ejkz_open(zfile, &h, &offsets);
+  if (fd < 0) return NULL;
+  ejkmap *m = ejkmap_new_text();
+  ejkz_set_geometry(m, &h);
+  long nalloc = 0;
+  int ilst, ilen, ibst, iben;
+  ejkmap_range(m, lst, len, bst, ben, &ilst, &ilen, &ibst, &iben);
+  unsigned char *buf = NULL;
+  size_t nbuf = 0;
+  for (int jl = ilst / EJKZ_BLOCK; jl <= ilen / EJKZ_BLOCK; jl++){
+    for (int jb = ibst / EJKZ_BLOCK; jb <= iben / EJKZ_BLOCK; jb++){
+      long iblock = (long) jl * h.nbblock + jb;
+      const unsigned char *end = ejkz_read_block(fd, offsets, iblock, &buf, &nbuf, zfile);
+      if (ejkz_decode_block(m, jl * EJKZ_BLOCK, jb * EJKZ_BLOCK, buf, end, &nalloc, NULL) != 0){
+        printf("%s is corrupted at block %ld!\n", zfile, iblock);
+        exit(1);
+      }
+    }
+  }
+  free(buf);
+  free(offsets);
+  close(fd);
+  return m;
+}
+//----------------
+ejkmap *ejkmap_open_tiled(const char *zfile, int maxtile)
+/* Open the block-compressed map without reading any block.
+ * ejkmap_grid() decodes the block of a grid on first use and keeps up to maxtile decoded blocks (tiles). */
+{
+  ejkz_header h;
+  int64_t *offsets;
+  int fd = ejkz_open(zfile, &h, &offsets);
+  if (fd < 0) return NULL;
+  ejkmap *m = calloc(1, sizeof(ejkmap));
+  ejkz_set_geometry(m, &h);
+  m->nsubrow = h.nsubrow;
+  ejkz_tiles *ts = calloc(1, sizeof(ejkz_tiles));
+  ts->fd = fd;
+  ts->name = strdup(zfile);
+  ts->offsets = offsets;
+  ts->nlblock = h.nlblock, ts->nbblock = h.nbblock;
+  long nblock = (long) h.nlblock * h.nbblock;
+  ts->slot = malloc(sizeof(int) * nblock);
+  for (long i=0; i<nblock; i++) ts->slot[i] = -1;
+  ts->maxtile = (maxtile < 1) ? 1 : maxtile;
+  ts->tile = calloc(ts->maxtile, sizeof(ejkz_tile));
+  m->tiles = ts;
+  return m;
+}
+//----------------
+static const ejkz_tile *ejkz_fetch(ejkmap *m, int il, int ib)
+/* Return the tile of the block containing grid (il, ib), decoding it in place of the least recently used one if needed */
+{
+  ejkz_tiles *ts = m->tiles;
+  long iblock = (long) (il / EJKZ_BLOCK) * ts->nbblock + ib / EJKZ_BLOCK;
+  int itile = ts->slot[iblock];
+  if (itile < 0){
+    if (ts->ntile < ts->maxtile){
+      itile = ts->ntile++;
+      ts->tile[itile].sub = malloc(sizeof(double) * EJKZ_BLOCK * EJKZ_BLOCK * (m->nsub > 0 ? m->nsub : 1));
+    }else{
+      itile = 0;
+      for (int i=1; i<ts->ntile; i++){
+        if (ts->tile[i].used < ts->tile[itile].used) itile = i;
+      }
+      ts->slot[ts->tile[itile].iblock] = -1;
+    }
+    ejkz_tile *t = &ts->tile[itile];
+    for (int i=0; i<EJKZ_BLOCK*EJKZ_BLOCK; i++) t->isub[i] = -1;
+    const unsigned char *end = ejkz_read_block(ts->fd, ts->offsets, iblock, &ts->buf, &ts->nbuf, ts->name);
+    if (ejkz_decode_block(m, il / EJKZ_BLOCK * EJKZ_BLOCK, ib / EJKZ_BLOCK * EJKZ_BLOCK, ts->buf, end, NULL, t) != 0){
+      printf("%s is corrupted at block %ld!\n", ts->name, iblock);
+      exit(1);
+    }
+    t->iblock = iblock;
+    ts->slot[iblock] = itile;
+    ts->nload++;
+  }
+  ts->tile[itile].used = ++ts->clock;
+  return &ts->tile[itile];
+}
+//----------------
+int ejkmap_exists(const char *fileEJK)
+/* Return 1 if the map is available as text, binary or compressed file */
+{
+  char binfile[1000], zfile[1000];
+  ejkmap_sidename(fileEJK, ".bin", binfile, sizeof(binfile));
+  ejkmap_sidename(fileEJK, ".ejz", zfile, sizeof(zfile));
+  return access(binfile, R_OK) == 0 || access(zfile, R_OK) == 0 || access(fileEJK, R_OK) == 0;
+}
+//----------------
+ejkmap *ejkmap_open(const char *fileEJK, double lst, double len, double bst, double ben, int maxtile)
+/* Open the map for the input area lst < l < len, bst < b < ben.
+ * The compressed map is read as tiles on demand when maxtile > 0, otherwise the blocks in the area are read at once. */
+{
+  char binfile[1000], zfile[1000];
+  ejkmap_sidename(fileEJK, ".bin", binfile, sizeof(binfile));
+  ejkmap_sidename(fileEJK, ".ejz", zfile, sizeof(zfile));
+  ejkmap *m = ejkmap_map_bin(binfile);
+  if (m == NULL && maxtile > 0) m = ejkmap_open_tiled(zfile, maxtile);
+  if (m == NULL && maxtile < 1) m = ejkmap_read_ejz(zfile, lst, len, bst, ben);
+  if (m == NULL) m = ejkmap_read_text_range(fileEJK, lst, len, bst, ben);
+  if (m == NULL){
+    printf("can't open %s\n",fileEJK);
+    exit(1);
+  }
+  return m;
+}
+//----------------
+static void ejkmap_bin_header(const ejkmap *m, ejkbin_header *h)
+{
+  long ngrid = (long) m->nl * m->nb;
+  memset(h, 0, sizeof(ejkbin_header));
+  memcpy(h->magic, EJKBIN_MAGIC, 8);
+  h->version = EJKBIN_VERSION;
+  h->nl = m->nl, h->nb = m->nb, h->nsub = m->nsub, h->nsubrow = m->nsubrow;
+  h->l0e4 = m->l0e4, h->b0e4 = m->b0e4, h->dle4 = m->dle4, h->dbe4 = m->dbe4;
+  h->off_mean = sizeof(ejkbin_header);
+  h->off_isub = h->off_mean + sizeof(double) * ngrid;
+  h->off_sub  = h->off_isub + sizeof(int32_t) * ngrid;
+  h->off_sub  = (h->off_sub + 7) / 8 * 8; // keep doubles aligned
+}
+//----------------
+size_t ejkmap_image_size(const ejkmap *m)
+/* Size of the map in the binary layout */
+{
+  ejkbin_header h;
+  ejkmap_bin_header(m, &h);
+  return h.off_sub + sizeof(double) * m->nsubrow * m->nsub;
+}
+//----------------
+void ejkmap_write_image(const ejkmap *m, void *buf)
+/* Store the map in the binary layout in buf of ejkmap_image_size(m) bytes */
+{
+  long ngrid = (long) m->nl * m->nb;
+  ejkbin_header h;
+  ejkmap_bin_header(m, &h);
+  memset(buf, 0, h.off_sub);
+  memcpy(buf, &h, sizeof(h));
+  memcpy((char *) buf + h.off_mean, m->mean, sizeof(double) * ngrid);
+  memcpy((char *) buf + h.off_isub, m->isub, sizeof(int32_t) * ngrid);
+  memcpy((char *) buf + h.off_sub,  m->sub,  sizeof(double) * m->nsubrow * m->nsub);
+}
+//----------------
+int ejkmap_write_bin(const ejkmap *m, const char *outfile)
+{
+  FILE *fp;
+  if((fp=fopen(outfile,"wb"))==NULL) return -1;
+  size_t size = ejkmap_image_size(m);
+  void *buf = malloc(size);
+  ejkmap_write_image(m, buf);
+  int nerr = fwrite(buf, 1, size, fp) != size;
+  nerr += fclose(fp) != 0;
+  free(buf);
+  return (nerr > 0) ? -1 : 0;
+}
+//----------------
+ejkmap *ejkmap_open_shared(const char *fileEJK)
+/* Open the entire map to be shared by genstars processes running side by side.
+ * The binary map is shared through the page cache by mmap. Otherwise the compressed or text map is read
+ * by the first process into a shared-memory segment (see shmtab.h) that the others attach.
+ * Return NULL when shared memory is unavailable. */
+{
+  char binfile[1000];
+  ejkmap_sidename(fileEJK, ".bin", binfile, sizeof(binfile));
+  ejkmap *m = ejkmap_map_bin(binfile);
+  if (m != NULL) return m;
+  char zfile[1000];
+  ejkmap_sidename(fileEJK, ".ejz", zfile, sizeof(zfile));
+  uint64_t key = shmtab_hash(0, EJKBIN_MAGIC, 8);
+  key = shmtab_hash(key, &(int){EJKBIN_VERSION}, sizeof(int));
+  key = shmtab_hash_file(key, fileEJK);
+  key = shmtab_hash_file(key, zfile);
+  shmtab *t = shmtab_open("genstars_ejk", key);
+  if (t == NULL) return NULL;
+  if (t->creator){
+    ejkmap *mt = ejkmap_read_ejz(zfile, -180, 180, -90, 90);
+    if (mt == NULL) mt = ejkmap_read_text(fileEJK);
+    if (mt == NULL){
+      printf("can't open %s\n",fileEJK);
+      exit(1);
+    }
+    ejkmap_write_image(mt, shmtab_reserve(t, ejkmap_image_size(mt)));
+    shmtab_ready(t);
+    ejkmap_close(mt);
+  }
+  size_t size;
+  const void *image = shmtab_data(t, &size);
+  m = ejkmap_from_image(image, size, t->name);
+  if (m == NULL) exit(1);
+  m->shm = t;
+  return m;
+}
+//----------------
+void ejkmap_close(ejkmap *m)
+{
+  if (m->map != NULL) munmap(m->map, m->mapsize);
+  if (m->shm != NULL) shmtab_close(m->shm);
+  if (m->tiles != NULL){
+    ejkz_tiles *ts = m->tiles;
+    for (int i=0; i<ts->ntile; i++) free(ts->tile[i].sub);
+    close(ts->fd);
+    free(ts->tile);
+    free(ts->slot);
+    free(ts->offsets);
+    free(ts->buf);
+    free(ts->name);
+    free(ts);
+  }
+  free(m->mean_buf);
+  free(m->isub_buf);
+  free(m->sub_buf);
+  free(m);
+}
+//----------------
+void ejkmap_range(const ejkmap *m, double lst, double len, double bst, double ben, int *ilst, int *ilen, int *ibst, int *iben)
+/* Give index ranges of grids that can overlap with lst < l < len, bst < b < ben.
+ * One extra grid is included on each side, the exact overlap is checked by the caller. */
+{
+  *ilst = floor((1e+4*lst - m->l0e4)/m->dle4) - 1;
+  *ilen =  ceil((1e+4*len - m->l0e4)/m->dle4) + 1;
+  *ibst = floor((1e+4*bst - m->b0e4)/m->dbe4) - 1;
+  *iben =  ceil((1e+4*ben - m->b0e4)/m->dbe4) + 1;
+  if (*ilst < 0) *ilst = 0;
+  if (*ibst < 0) *ibst = 0;
+  if (*ilen > m->nl - 1) *ilen = m->nl - 1;
+  if (*iben > m->nb - 1) *iben = m->nb - 1;
+}
+//----------------
+void ejkmap_center(const ejkmap *m, int il, int ib, double *lb)
+/* Put (l, b) of the grid center in lb */
+{
+  lb[0] = (m->l0e4 + il * m->dle4) / 10000.0; // same double as atof() of the 4-digit value in the text
+  lb[1] = (m->b0e4 + ib * m->dbe4) / 10000.0;
+}
+//----------------
+int ejkmap_grid(ejkmap *m, int il, int ib, double *lb, double *vals)
+/* Put (l, b) of the grid center in lb, the mean E(J-Ks) in vals[0] and subgrid values in vals[1..nsub].
+ * Return the number of values stored in vals. */
+{
+  long igrid = (long) il * m->nb + ib;
+  ejkmap_center(m, il, ib, lb);
+  if (m->tiles != NULL){
+    const ejkz_tile *t = ejkz_fetch(m, il, ib);
+    int jgrid = (il % EJKZ_BLOCK) * EJKZ_BLOCK + ib % EJKZ_BLOCK;
+    vals[0] = t->mean[jgrid];
+    if (t->isub[jgrid] < 0) return 1;
+    memcpy(vals + 1, t->sub + (long) t->isub[jgrid] * m->nsub, sizeof(double) * m->nsub);
+    return m->nsub + 1;
+  }
+  vals[0] = m->mean[igrid];
+  if (m->isub[igrid] < 0) return 1;
+  memcpy(vals + 1, m->sub + (long) m->isub[igrid] * m->nsub, sizeof(double) * m->nsub);
+  return m->nsub + 1;
+}
@@ -0,0 +1,131 @@
+/* Access to the E(J-Ks) extinction map (Gonzalez+12 + Surot+20) used by genstars.
+ * The map is a dense grid of 0.025x0.025 deg^2 grids covering -9.5 < l < 9.5 and -10 < b < 4.5,
+ * ordered l-major as in input_files/EJK_G12_S20_LR.dat.
+ * Each grid has the mean E(J-Ks) and, at |b| < 4 deg, nsub (25 or 100) subgrid values.
+ * Three representations are supported:
+ *   text       (*.dat) : the original one-line-per-grid file. Only the lines of grids inside the input area are
+ *                        parsed, using the byte offset of every line stored in the sidecar index (*.idx),
+ *                        which is made by scanning the text on first use and rebuilt when the text changes.
+ *   binary     (*.bin) : written by ejkconv, mmap-ed and accessed in O(1) per grid
+ *   compressed (*.ejz) : written by ejkconv, blocks of EJKZ_BLOCK x EJKZ_BLOCK grids compressed separately,
+ *                        only blocks overlapping with the input area are read and decompressed.
+ *                        In a block, the mean and subgrid values are stored as decimal integers k at 10^-d,
+ *                        with d the fewest decimals giving back the same double, delta-encoded with zigzag varints.
+ *                        Decoded values are identical to those parsed from the text.
+ * ejkmap_open() uses the binary file next to the text file when it exists, then the compressed file.
+ * With maxtile > 0, blocks of the compressed file are decoded on demand by ejkmap_grid() as tiles, keeping
+ * at most maxtile decoded tiles with least-recently-used replacement, so that even the 0.0025 deg map
+ * (EJK_G12_S20.ejz, EXTMAP 0) costs memory and time only for the tiles the input area needs.
+ * ejkmap_open_shared() opens the entire map to be shared with other genstars processes (option SHM). */
+#include <stddef.h>
+#include <stdint.h>
+
+#define EJKBIN_MAGIC   "GSEJKBIN"
+#define EJKBIN_VERSION 1
+
+// Grid geometry in units of 1e-4 deg, common to all E(J-Ks) map files
+#define EJK_L0E4    -94875  // l of the center of the first grid
+#define EJK_B0E4    -99875  // b of the center of the first grid
+#define EJK_DE4        250  // grid width
+#define EJK_NL         760
+#define EJK_NB         580
+#define EJK_NSUBMAX    100  // 10x10 subgrids of 0.0025x0.0025 deg^2 in EJK_G12_S20.dat
+
+typedef struct {
+  char    magic[8];
+  int32_t version;
+  int32_t nl, nb;          // number of grids along l and b
+  int32_t l0e4, b0e4;      // center of grid (0, 0) in 1e-4 deg
+  int32_t dle4, dbe4;      // grid width in 1e-4 deg
+  int32_t nsub;            // number of subgrids in a grid (0 if no subgrid)
+  int64_t nsubrow;         // number of grids having subgrid values
+  int64_t off_mean;        // byte offset of double  mean[nl*nb]
+  int64_t off_isub;        // byte offset of int32_t isub[nl*nb], -1 for a grid without subgrid
+  int64_t off_sub;         // byte offset of double  sub[nsubrow*nsub]
+} ejkbin_header;
+
+#define EJKZ_MAGIC     "GSEJKZIP"
+#define EJKZ_VERSION   1
+#define EJKZ_BLOCK     16   // grids along l and b in a block
+#define EJKZ_DECMAX    17   // max decimals of values stored as integers
+#define EJKZ_RAW       31   // decimals code of values stored as raw doubles
+#define EJKZ_HASSUB  0x80   // flag on the decimals code of a mean value followed by subgrid values
+
+typedef struct {
+  char    magic[8];
+  int32_t version;
+  int32_t nl, nb;
+  int32_t l0e4, b0e4;
+  int32_t dle4, dbe4;
+  int32_t nsub;
+  int32_t block;           // EJKZ_BLOCK
+  int32_t nlblock, nbblock; // number of blocks along l and b
+  int32_t pad;
+  int64_t nsubrow;
+} ejkz_header;             // followed by int64_t offset[nlblock*nbblock+1] of each block (l-major), then blocks
+
+#define EJKIDX_MAGIC   "GSEJKIDX"
+#define EJKIDX_VERSION 1
+
+typedef struct {
+  char    magic[8];
+  int32_t version;
+  int32_t nl, nb;
+  int32_t pad;
+  int64_t txtsize;         // size and modification time of the text file indexed
+  int64_t txtmtime;
+} ejkidx_header;           // followed by int64_t offset[nl*nb] of each line, -1 for a missing grid
+
+typedef struct {
+  int     iblock;          // block decoded in this tile, -1 if empty
+  long    used;            // time of the last access for LRU replacement
+  double  mean[EJKZ_BLOCK*EJKZ_BLOCK];  // l-major in the block
+  int32_t isub[EJKZ_BLOCK*EJKZ_BLOCK];  // -1 for a grid without subgrid
+  double *sub;             // EJKZ_BLOCK*EJKZ_BLOCK*nsub
+} ejkz_tile;
+
+typedef struct {
+  int      fd;
+  char    *name;
+  int64_t *offsets;        // of each block in the file
+  int      nlblock, nbblock;
+  int     *slot;           // tile holding each block, -1 if not decoded
+  int      ntile, maxtile;
+  ejkz_tile *tile;
+  long     clock;          // number of accesses
+  long     nload;          // number of blocks decoded
+  unsigned char *buf;
+  size_t   nbuf;
+} ejkz_tiles;
+
+typedef struct {
+  int nl, nb, nsub;
+  int l0e4, b0e4, dle4, dbe4;
+  long nsubrow;
+  const double  *mean;
+  const int32_t *isub;
+  const double  *sub;
+  void   *map;             // mmap-ed binary file, NULL for text
+  size_t  mapsize;
+  void   *shm;             // shared-memory segment holding the map (ejkmap_open_shared)
+  ejkz_tiles *tiles;       // tiled compressed map, mean/isub/sub are unused
+  double  *mean_buf, *sub_buf; // allocated when read from text
+  int32_t *isub_buf;
+} ejkmap;
+
+int     ejkmap_exists(const char *fileEJK);
+ejkmap *ejkmap_open(const char *fileEJK, double lst, double len, double bst, double ben, int maxtile);
+ejkmap *ejkmap_open_shared(const char *fileEJK);
+ejkmap *ejkmap_read_text(const char *fileEJK);
+ejkmap *ejkmap_read_ejz(const char *zfile, double lst, double len, double bst, double ben);
+ejkmap *ejkmap_open_tiled(const char *zfile, int maxtile);
+ejkmap *ejkmap_read_text_range(const char *fileEJK, double lst, double len, double bst, double ben);
+int  ejkmap_write_bin(const ejkmap *m, const char *outfile);
+int  ejkmap_write_ejz(const ejkmap *m, const char *outfile);
+size_t ejkmap_image_size(const ejkmap *m);
+void ejkmap_write_image(const ejkmap *m, void *buf);
+void ejkmap_close(ejkmap *m);
+void ejkmap_sidename(const char *fileEJK, const char *ext, char *sidefile, size_t n);
+void ejkmap_range(const ejkmap *m, double lst, double len, double bst, double ben, int *ilst, int *ilen, int *ibst, int *iben);
+void ejkmap_center(const ejkmap *m, int il, int ib, double *lb);
+int  ejkmap_grid(ejkmap *m, int il, int ib, double *lb, double *vals);
@@ -0,0 +1,167 @@
+/* Merge the outputs of the shards of a genstars run (see shard.h) into the output of the single run.
+ *   usage: ./genmerge out_0.txt out_1.txt ... out_{N-1}.txt > out.txt
+ * where out_i.txt is the output of "./genstars ... SHARD i N". The shards can be given in any order.
+ * The header is taken from the first shard without "SHARD i N" in the command line, the grids are copied
+ * in the order of shards, and the summary lines are recomputed from the counts of the grids in the manifests,
+ * so the result is byte-identical to the output of the same run without SHARD.
+ * Shards made with different parameters, missing or duplicated shards are reported as errors. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "option.h"
+#include "shard.h"
+
+#define HEADER_END  "#---- Read extinction map"
+#define SUMMARY_TOP "# sumM_MS/sumN_MS="
+
+typedef struct {
+  char  *name;
+  int    ishard, nshard, rng, binary;
+  long   ngrid, i0, i1, seed;
+  char  *header;             // lines before the grids, without SHARD in the command line
+  off_t  body0, body1;       // byte range of the grids
+  cellcount *cnt;            // counts of grids i0, ..., i1-1
+} shard;
+
+//----------------
+void strip_shard(char *line)
+/* Remove "SHARD i N" from the command line echoed in the header */
+{
+  if (strncmp(line, "#   Output of \"./genstars", 25) != 0) return;
+  char *p = strstr(line, " SHARD ");
+  if (p == NULL) return;
+  char *q = p + 7;
+  q += strcspn(q, " \"\n");
+  q += strspn(q, " ");
+  q += strcspn(q, " \"\n");
+  memmove(p, q, strlen(q) + 1);
+  // without other arguments, genstars writes "./genstars "
+  if ((p = strstr(line, "./genstars\"")) != NULL){
+    memmove(p + 11, p + 10, strlen(p + 10) + 1);
+    p[10] = ' ';
+  }
+}
+//----------------
+void read_shard(shard *s, const char *name)
+{
+  FILE *fp = fopen(name, "r");
+  if (fp == NULL){
+    fprintf(stderr, "can't open %s\n", name);
+    exit(1);
+  }
+  memset(s, 0, sizeof(shard));
+  s->name = (char *) name;
+  s->nshard = -1;
+  size_t nheader = 0, size = 0;
+  char  *line = NULL;
+  size_t nline = 0;
+  int    part = 0; // 0: header, 1: grids, 2: summary and manifest
+  long   ncnt = 0;
+  for (;;){
+    off_t pos = ftello(fp);
+    ssize_t len = getline(&line, &nline, fp);
+    if (len < 0) break;
+    if (part == 0){
+      if (strncmp(line, "#   Output of", 13) == 0) strip_shard(line), len = strlen(line);
+      if (nheader + len + 1 > size){
+        size = 2 * (nheader + len + 1);
+        s->header = realloc(s->header, size);
+      }
+      memcpy(s->header + nheader, line, len + 1);
+      nheader += len;
+      if (strncmp(line, HEADER_END, strlen(HEADER_END)) == 0) part = 1, s->body0 = ftello(fp);
+    } else if (part == 1){
+      if (strncmp(line, SUMMARY_TOP, strlen(SUMMARY_TOP)) == 0) part = 2, s->body1 = pos;
+    } else if (s->nshard < 0){
+      if (shard_read_head(line, &s->ishard, &s->nshard, &s->ngrid, &s->i0, &s->i1, &s->seed, &s->rng, &s->binary) == 0){
+        if (s->nshard < 1 || s->i0 < 0 || s->i1 < s->i0 || s->i1 > s->ngrid){
+          fprintf(stderr, "%s: broken manifest!\n", name);
+          exit(1);
+        }
+        s->cnt = (cellcount *) calloc(s->i1 - s->i0 + 1, sizeof(cellcount));
+      }
+    } else {
+      long igrid;
+      int  il, ib;
+      unsigned long stream;
+      cellcount cnt;
+      if (shard_read_grid(line, &igrid, &il, &ib, &stream, &cnt) != 0) continue;
+      if (igrid != s->i0 + ncnt || igrid >= s->i1){
+        fprintf(stderr, "%s: grid %ld is not expected in the manifest!\n", name, igrid);
+        exit(1);
+      }
+      s->cnt[ncnt++] = cnt;
+    }
+  }
+  free(line);
+  fclose(fp);
+  if (s->nshard < 0){
+    fprintf(stderr, "%s has no manifest. Is it the complete output of genstars with SHARD i N?\n", name);
+    exit(1);
+  }
+  if (ncnt != s->i1 - s->i0){
+    fprintf(stderr, "%s: %ld grids in the manifest, %ld expected!\n", name, ncnt, s->i1 - s->i0);
+    exit(1);
+  }
+}
+//----------------
+int compare_shard(const void *a, const void *b)
+{
+  return ((const shard *) a)->ishard - ((const shard *) b)->ishard;
+}
+//----------------
+int main(int argc,char **argv)
+{
+  if (argc < 2){
+    printf("usage: %s out_0.txt out_1.txt ... (outputs of genstars with SHARD 0 N, SHARD 1 N, ...) > out.txt\n",argv[0]);
+    exit(1);
+  }
+  int nshard = argc - 1;
+  shard *s = (shard *) calloc(nshard, sizeof(shard));
+  for (int i=0; i<nshard; i++) read_shard(&s[i], argv[i+1]);
+  qsort(s, nshard, sizeof(shard), compare_shard);
+  // The shards have to be all of a single run
+  for (int i=0; i<nshard; i++){
+    if (s[i].nshard != nshard || s[i].ishard != i){
+      fprintf(stderr, "%s is shard %d of %d, but shards 0, ..., %d are expected!\n", s[i].name, s[i].ishard, s[i].nshard, nshard-1);
+      exit(1);
+    }
+    if (strcmp(s[i].header, s[0].header) != 0 || s[i].ngrid != s[0].ngrid || s[i].seed != s[0].seed
+        || s[i].rng != s[0].rng || s[i].binary != s[0].binary){
+      fprintf(stderr, "%s is made with parameters different from %s!\n", s[i].name, s[0].name);
+      exit(1);
+    }
+    if (s[i].i0 != ((i == 0) ? 0 : s[i-1].i1) || (i == nshard - 1 && s[i].i1 != s[i].ngrid)){
+      fprintf(stderr, "%s has grids %ld - %ld, which do not continue from the previous shard!\n", s[i].name, s[i].i0, s[i].i1 - 1);
+      exit(1);
+    }
+  }
+  // Write the header, grids, and summary of all grids
+  fputs(s[0].header, stdout);
+  cellcount sum = {};
+  char *buf = malloc(1 << 20);
+  for (int i=0; i<nshard; i++){
+    FILE *fp = fopen(s[i].name, "r");
+    if (fp == NULL || fseeko(fp, s[i].body0, SEEK_SET) != 0){
+      fprintf(stderr, "can't read %s\n", s[i].name);
+      exit(1);
+    }
+    for (off_t left = s[i].body1 - s[i].body0; left > 0; ){
+      size_t n = fread(buf, 1, (left < (1 << 20)) ? left : (1 << 20), fp);
+      if (n == 0){
+        fprintf(stderr, "can't read %s\n", s[i].name);
+        exit(1);
+      }
+      fwrite(buf, 1, n, stdout);
+      left -= n;
+    }
+    fclose(fp);
+    for (long j=0; j<s[i].i1 - s[i].i0; j++) cellcount_add(&sum, &s[i].cnt[j]);
+  }
+  cellcount_print(stdout, &sum, s[0].binary);
+  free(buf);
+  for (int i=0; i<nshard; i++) free(s[i].header), free(s[i].cnt);
+  free(s);
+  return 0;
+}
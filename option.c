@@ -60,3 +60,62 @@ int split(char *splitw, const char *s, char *word[])
    }
    return count;
 }
+/* -------------------------------------------------------------------*/
+int tokenize(char *s, char *word[], int maxword)
+/* Split a line into words separated by blanks in place, without allocation.
+ * Blanks after words are overwritten by '\0', so word[i] point into s and are valid as long as s is.
+ * At most maxword words are returned. word[0] is "" for a blank line. */
+{
+   int count = 0;
+   word[0] = s + strlen(s);
+   while (count < maxword) {
+      while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r')   /* skip white space */
+           ++s;
+      if (*s == '\0') break;
+      word[count++] = s;         /* found a word */
+      while (*s != ' ' && *s != '\t' && *s != '\n' && *s != '\r' && *s != '\0')
+           ++s;
+      if (*s == '\0') break;
+      *s++ = '\0';
+   }
+   return count;
+}
+/* -------------------------------------------------------------------*/
+double parse_double(const char *s)
+/* Fast replacement of atof() for plain decimal numbers like "-9.4875", "0.6030000000" or "1.5e-3".
+ * When the digits fit in 2^53 and the decimal exponent is within +-22, both the digits and 10^|exp|
+ * are exact doubles and one multiplication or division gives the correctly rounded value,
+ * i.e. the same double as atof(). Other inputs are passed to strtod(). */
+{
+   static const double pow10[23] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+   const char *p = s;
+   while (*p == ' ' || *p == '\t') ++p;
+   int neg = 0;
+   if (*p == '-' || *p == '+') neg = (*p++ == '-');
+   unsigned long long m = 0;
+   int ndig = 0, nsig = 0, exp10 = 0;
+   for (; *p >= '0' && *p <= '9'; ++p, ++ndig){
+      if (m == 0 && *p == '0') continue;  /* leading zeros */
+      m = 10*m + (*p - '0'), ++nsig;
+   }
+   if (*p == '.'){
+      for (++p; *p >= '0' && *p <= '9'; ++p, ++ndig){
+         m = 10*m + (*p - '0'), --exp10;
+         if (m > 0) ++nsig;
+      }
+   }
+   if (ndig == 0 || nsig > 19) return strtod(s, NULL);
+   if (*p == 'e' || *p == 'E'){
+      const char *q = p + 1;
+      int eneg = 0, e = 0;
+      if (*q == '-' || *q == '+') eneg = (*q++ == '-');
+      if (*q < '0' || *q > '9') return strtod(s, NULL);
+      for (; *q >= '0' && *q <= '9' && e < 10000; ++q) e = 10*e + (*q - '0');
+      exp10 += eneg ? -e : e;
+   }
+   if (m > (1ULL << 53) || exp10 < -22 || exp10 > 22) return strtod(s, NULL);
+   double x = (double) m;
+   x = (exp10 < 0) ? x / pow10[-exp10] : x * pow10[exp10];
+   return neg ? -x : x;
+}
@@ -8,3 +8,5 @@ int getOptioni(int argc, char *argv[], const char *argname, int argno, int def_v
 double getOptiond(int argc, char *argv[], const char *argname, int argno, double def_value);
 
 int split(char *splitw, const char *s, char *word[]);
+int tokenize(char *s, char *word[], int maxword);
+double parse_double(const char *s);
@@ -0,0 +1,140 @@
+/* Ordered merge of outputs made in parallel (see outmerge.h). */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "outmerge.h"
+
+//----------------
+void outbuf_printf(outbuf *b, const char *format, ...)
+/* printf() appending to b */
+{
+  va_list ap;
+  for (;;){
+    size_t room = b->size - b->n;
+    va_start(ap, format);
+    int len = vsnprintf(b->p + b->n, room, format, ap);
+    va_end(ap);
+    if (len < 0){
+      printf("outbuf_printf: can't format %s\n", format);
+      exit(1);
+    }
+    if ((size_t) len < room){
+      b->n += len;
+      return;
+    }
+    b->size = (b->size == 0) ? 65536 : 2 * b->size;
+    if (b->size < b->n + len + 1) b->size = b->n + len + 1;
+    b->p = realloc(b->p, b->size);
+  }
+}
+//----------------
+void outbuf_write(outbuf *b, const char *p, size_t n)
+/* Append n bytes of p to b */
+{
+  if (b->n + n + 1 > b->size){
+    b->size = (b->size == 0) ? 65536 : 2 * b->size;
+    if (b->size < b->n + n + 1) b->size = b->n + n + 1;
+    b->p = realloc(b->p, b->size);
+  }
+  memcpy(b->p + b->n, p, n);
+  b->n += n;
+  b->p[b->n] = '\0';
+}
+//----------------
+void outbuf_free(outbuf *b)
+{
+  free(b->p);
+  memset(b, 0, sizeof(outbuf));
+}
+//----------------
+outmerge *outmerge_open(FILE *fp, int window, size_t recsize, void (*emit)(void *arg, const void *rec), void *arg)
+{
+  outmerge *m = calloc(1, sizeof(outmerge));
+  m->fp = fp;
+  m->window = (window < 1) ? 1 : window;
+  m->slots = calloc(m->window, sizeof(outmerge_slot));
+  m->recsize = recsize;
+  m->recs = calloc(m->window, (recsize > 0) ? recsize : 1);
+  m->emit = emit;
+  m->arg = arg;
+  pthread_mutex_init(&m->lock, NULL);
+  pthread_cond_init(&m->moved, NULL);
+  return m;
+}
+//----------------
+void outmerge_limit(outmerge *m, int maxtaken)
+/* Let outmerge_take() give at most maxtaken items that are not put yet (0: no limit) */
+{
+  pthread_mutex_lock(&m->lock);
+  m->maxtaken = (maxtaken > 0) ? maxtaken : 0;
+  pthread_mutex_unlock(&m->lock);
+}
+//----------------
+long outmerge_take(outmerge *m, long n, const double *cost)
+/* Take the next item to process among items 0, ..., n-1, -1 when all are taken.
+ * It is the item of the largest cost[i] (the first one of equal costs, or in order if cost is NULL)
+ * among those not taken within the window. Waits while all items in the window are taken,
+ * or while maxtaken items taken are not put yet. */
+{
+  long ibest;
+  pthread_mutex_lock(&m->lock);
+  for (;;){
+    ibest = -1;
+    long iend = (m->next + m->window < n) ? m->next + m->window : n;
+    for (long i = m->next; i < iend; i++){
+      if (m->slots[i % m->window].state != 0) continue;
+      if (ibest < 0) ibest = i;
+      if (cost == NULL) break;
+      if (cost[i] > cost[ibest]) ibest = i;
+    }
+    if (ibest < 0 && iend == n) break;
+    if (ibest >= 0 && (m->maxtaken == 0 || m->ntaken < m->maxtaken)) break;
+    pthread_cond_wait(&m->moved, &m->lock);
+  }
+  if (ibest >= 0) m->slots[ibest % m->window].state = 1, m->ntaken++;
+  pthread_mutex_unlock(&m->lock);
+  return ibest;
+}
+//----------------
+void outmerge_put(outmerge *m, long i, outbuf *b, const void *rec)
+/* Hand the output of item i in b, and its record rec, to the merge.
+ * b is given back empty, holding the memory of an item written before, to be reused for the next item. */
+{
+  pthread_mutex_lock(&m->lock);
+  while (i >= m->next + m->window) pthread_cond_wait(&m->moved, &m->lock);
+  outmerge_slot *s = &m->slots[i % m->window];
+  outbuf spare = s->buf;
+  s->buf = *b;
+  int wastaken = (s->state == 1);
+  if (wastaken) m->ntaken--;
+  s->state = 2;
+  if (m->recsize > 0) memcpy(m->recs + (i % m->window) * m->recsize, rec, m->recsize);
+  *b = spare;
+  b->n = 0;
+  // Write the items ready in order
+  int moved = 0;
+  while ((s = &m->slots[m->next % m->window])->state == 2){
+    if (s->buf.n > 0 && fwrite(s->buf.p, 1, s->buf.n, m->fp) != s->buf.n){
+      printf("outmerge: write error!\n");
+      exit(1);
+    }
+    if (m->emit != NULL) m->emit(m->arg, m->recs + (m->next % m->window) * m->recsize);
+    s->buf.n = 0;
+    s->state = 0;
+    m->next++;
+    moved = 1;
+  }
+  if (moved || wastaken) pthread_cond_broadcast(&m->moved);
+  pthread_mutex_unlock(&m->lock);
+}
+//----------------
+void outmerge_close(outmerge *m)
+{
+  for (int i=0; i<m->window; i++) outbuf_free(&m->slots[i].buf);
+  pthread_mutex_destroy(&m->lock);
+  pthread_cond_destroy(&m->moved);
+  free(m->slots);
+  free(m->recs);
+  free(m);
+}
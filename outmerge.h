@@ -0,0 +1,48 @@
+/* Ordered merge of outputs made in parallel.
+ * Each worker formats the output of an item (a grid in genstars) into its own growable buffer with outbuf_printf()
+ * and hands it to outmerge_put() with the sequence number of the item. Items are written to the output in the order
+ * of their sequence numbers, 0, 1, 2, ..., as soon as all items before them are finished, so the output is
+ * byte-identical to that of a serial run.
+ * At most window finished items wait for earlier ones; a worker finishing an item further ahead waits until the
+ * window moves, so the memory held is bounded. Workers have to take items in increasing order of sequence numbers,
+ * or from outmerge_take(), which gives the most costly item not yet taken among the window items from the oldest
+ * unwritten one, so that costly items start as early as the window allows and outmerge_put() never waits.
+ * After outmerge_limit(m, maxtaken), outmerge_take() also waits while maxtaken items taken are not put yet,
+ * so that a thread handing items to maxtaken workers takes an item only when a worker is free.
+ * A fixed-size record (e.g. counts) can be given with each item; emit() is called for the records in the same order. */
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+
+typedef struct {
+  char  *p;
+  size_t n, size;          // used and allocated bytes
+} outbuf;
+
+typedef struct {
+  outbuf buf;
+  int    state;            // 0: not taken, 1: taken by outmerge_take(), 2: finished
+} outmerge_slot;
+
+typedef struct {
+  FILE  *fp;
+  int    window;
+  long   next;             // sequence number of the next item to write
+  int    ntaken, maxtaken; // items taken by outmerge_take() and not put yet, at most maxtaken (0: no limit)
+  outmerge_slot *slots;    // item i waits in slots[i % window]
+  char  *recs;             // records of the waiting items
+  size_t recsize;
+  void (*emit)(void *arg, const void *rec);
+  void  *arg;
+  pthread_mutex_t lock;
+  pthread_cond_t  moved;   // signaled when next advances or a taken item is put
+} outmerge;
+
+void outbuf_printf(outbuf *b, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void outbuf_write(outbuf *b, const char *p, size_t n);
+void outbuf_free(outbuf *b);
+outmerge *outmerge_open(FILE *fp, int window, size_t recsize, void (*emit)(void *arg, const void *rec), void *arg);
+void outmerge_limit(outmerge *m, int maxtaken);
+long outmerge_take(outmerge *m, long n, const double *cost);
+void outmerge_put(outmerge *m, long i, outbuf *b, const void *rec);
+void outmerge_close(outmerge *m);
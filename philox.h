@@ -0,0 +1,68 @@
+/* Counter-based random numbers by Philox4x32-10 (Salmon et al. 2011, SC'11, "Parallel random numbers: as easy as 1, 2, 3").
+ * Each block of 4 32-bit numbers is a bijection of a 128-bit counter under a 64-bit key, so any number is
+ * computed directly from its address without generating those before it.
+ * genstars uses key = seed and counter = (draw / 4, star index (2 words), grid index), so that every star of
+ * every grid has its own sequence of draws, which is reproduced regardless of the order stars are generated in. */
+#include <stdint.h>
+
+#define PHILOX_M0 0xD2511F53U
+#define PHILOX_M1 0xCD9E8D57U
+#define PHILOX_W0 0x9E3779B9U
+#define PHILOX_W1 0xBB67AE85U
+
+typedef struct {
+  uint32_t key[2];
+  uint32_t ctr[4];         // block of draws, star index (low, high), grid index
+  uint32_t out[4];         // the current block
+  int      iout;           // next number in out, 4 when a new block is needed
+} philox_stream;
+
+static inline void philox4x32(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4])
+{
+  uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+  uint32_t k0 = key[0], k1 = key[1];
+  for (int i=0; i<10; i++){
+    uint64_t p0 = (uint64_t) PHILOX_M0 * c0;
+    uint64_t p1 = (uint64_t) PHILOX_M1 * c2;
+    c0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+    c2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+    c1 = (uint32_t) p1;
+    c3 = (uint32_t) p0;
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+  out[0] = c0, out[1] = c1, out[2] = c2, out[3] = c3;
+}
+
+static inline void philox_init(philox_stream *s, uint64_t seed, uint32_t cell)
+/* Start the stream of grid cell */
+{
+  s->key[0] = (uint32_t) seed;
+  s->key[1] = (uint32_t) (seed >> 32);
+  s->ctr[0] = s->ctr[1] = s->ctr[2] = 0;
+  s->ctr[3] = cell;
+  s->iout = 4;
+}
+
+static inline void philox_seek(philox_stream *s, uint64_t star, uint64_t draw)
+/* Move to the draw-th number of star */
+{
+  s->ctr[1] = (uint32_t) star;
+  s->ctr[2] = (uint32_t) (star >> 32);
+  s->ctr[0] = (uint32_t) (draw >> 2);
+  s->iout = draw & 3;
+  if (s->iout > 0) philox4x32(s->ctr, s->key, s->out);
+  else             s->iout = 4;
+}
+
+static inline double philox_uniform(philox_stream *s)
+/* Uniform random number in (0, 1) with 32-bit resolution. 0 is excluded as callers may divide by or take log of it. */
+{
+  if (s->iout == 4){
+    philox4x32(s->ctr, s->key, s->out);
+    s->iout = 0;
+  }
+  uint32_t x = s->out[s->iout++];
+  if (s->iout == 4) s->ctr[0]++;
+  return (x + 0.5) * (1.0 / 4294967296.0);
+}
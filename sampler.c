@@ -0,0 +1,114 @@
+/* Samplers of tabulated distributions drawing in O(1) time (see sampler.h). */
+#include <stdlib.h>
+#include <math.h>
+#include "sampler.h"
+
+//----------------
+void alias_build(int n, const double *w, double *prob, int *alias)
+/* Alias table of weights w[0], ..., w[n-1] by Vose's method. prob may be w, which is then overwritten.
+ * Without positive weights all items are equally likely. */
+{
+  double sum = 0;
+  for (int k=0; k<n; k++) sum += w[k];
+  // Columns of height 1 on average; those below 1 (small) are filled up by those above (large)
+  int *work = (int *)malloc(sizeof(int) * (n > 0 ? n : 1)); // small ones from the front, large ones from the back
+  int nsmall = 0, nlarge = 0;
+  for (int k=0; k<n; k++){
+    prob[k] = (sum > 0) ? w[k] / sum * n : 1;
+    alias[k] = k;
+    if (prob[k] < 1) work[nsmall++] = k;
+    else             work[n - ++nlarge] = k;
+  }
+  while (nsmall > 0 && nlarge > 0){
+    int s = work[--nsmall];
+    int l = work[n - nlarge--];
+    alias[s] = l;
+    prob[l] = (prob[l] + prob[s]) - 1;
+    if (prob[l] < 1) work[nsmall++] = l;
+    else             work[n - ++nlarge] = l;
+  }
+  // Left by round-off, with heights of 1 within the error
+  while (nsmall > 0) prob[work[--nsmall]] = 1;
+  while (nlarge > 0) prob[work[n - nlarge--]] = 1;
+  free(work);
+}
+//----------------
+void cdf_guide_build(int n, const double *F, int nguide, int *guide)
+/* Guide table of nguide buckets of nondecreasing F[0], ..., F[n-1]:
+ * guide[g] is the first segment i (1 <= i < n) with F[i] >= F[0] + (F[n-1] - F[0]) * g / nguide */
+{
+  int i = 1;
+  for (int g=0; g<nguide; g++){
+    double Fg = F[0] + (F[n-1] - F[0]) * g / nguide;
+    while (i < n - 1 && F[i] < Fg) i++;
+    guide[g] = i;
+  }
+}
+//----------------
+void cdftab_init(cdftab *t, int n, const double *x, const double *F, const double *f, int nguide)
+/* Table inverting F tabulated at n (>= 2) nodes x with the density f, linear between nodes */
+{
+  t->n = n;
+  t->nguide = (nguide > 0) ? nguide : 1;
+  t->F0 = F[0], t->F1 = F[n-1];
+  t->x0 = x[0], t->x1 = x[n-1];
+  t->gscale = (t->F1 > t->F0) ? t->nguide / (t->F1 - t->F0) : 0;
+  t->guide = (int *)malloc(sizeof(int) * t->nguide);
+  t->F     = (double *)malloc(sizeof(double) * n);
+  t->seg   = (cdfseg *)malloc(sizeof(cdfseg) * n);
+  for (int i=0; i<n; i++) t->F[i] = F[i];
+  for (int i=1; i<n; i++){
+    cdfseg *s = &t->seg[i];
+    // As in getcumu2xist()
+    s->a = 0.5*(f[i]-f[i-1])/(x[i]-x[i-1]);
+    s->b = f[i-1] - 2*s->a*x[i-1];
+    s->c = s->a*x[i-1]*x[i-1] - f[i-1]*x[i-1] + F[i-1];
+    s->x0 = x[i-1];
+    s->dxdF = (F[i] > F[i-1]) ? (x[i]-x[i-1])/(F[i]-F[i-1]) : 0;
+  }
+  t->seg[0] = t->seg[1];
+  cdf_guide_build(n, F, t->nguide, t->guide);
+}
+//----------------
+void cdftab_free(cdftab *t)
+{
+  free(t->guide);
+  free(t->F);
+  free(t->seg);
+  t->guide = NULL, t->F = NULL, t->seg = NULL;
+}
+//----------------
+double getcumu2xist(int n, double *x, double *F, double *f, double Freq, int ist, int inv){ 
+  // for cumulative distribution (assuming linear interpolation for f(x) when cumu = F = int f(x))
+  // Linear search from ist (a hint from percentiles of F), replaced by cdftab and kept for comparison in bench_sampler.
+  // The segments of a == 0 used to add F[i-1] instead of x[i-1].
+  double Fmax = F[n-1];
+  double Fmin = F[0];
+  if (Fmin > Freq) return 0;
+  if (Fmax < Freq) return 0;
+  if (ist < 1) ist = 1;
+  if (inv==0){
+    for(int i=ist;i<n;i++){
+       if ((F[i] <= Freq && F[i-1] > Freq) || (F[i] >= Freq && F[i-1] < Freq)){
+          double a = 0.5*(f[i]-f[i-1])/(x[i]-x[i-1]);
+          double b = f[i-1] - 2*a*x[i-1];
+          double c = a*x[i-1]*x[i-1] - f[i-1]*x[i-1] + F[i-1] - Freq;
+          double xreq = (a != 0) ? (-b + sqrt(b*b - 4*a*c)) * 0.5/a  // root of ax^2 +bx + c
+                                 : (x[i]-x[i-1])/(F[i]-F[i-1])*(Freq-F[i-1]) + x[i-1];
+          return xreq;
+       }
+    }
+  }else{
+    for(int i=ist;i>0;i--){
+       if ((F[i] <= Freq && F[i-1] > Freq) || (F[i] >= Freq && F[i-1] < Freq)){
+          double a = 0.5*(f[i]-f[i-1])/(x[i]-x[i-1]);
+          double b = f[i-1] - 2*a*x[i-1];
+          double c = a*x[i-1]*x[i-1] - f[i-1]*x[i-1] + F[i-1] - Freq;
+          double xreq = (a != 0) ? (-b + sqrt(b*b - 4*a*c)) * 0.5/a  // root of ax^2 +bx + c
+                                 : (x[i]-x[i-1])/(F[i]-F[i-1])*(Freq-F[i-1]) + x[i-1];
+          return xreq;
+       }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,89 @@
+/* Samplers of tabulated distributions drawing in O(1) time.
+ * An alias table (Walker 1977; Vose 1991, IEEE TSE 17, 972) of n weights picks one of n items with two uniform
+ * random numbers, u1 choosing a column and u2 choosing between the item of the column and its alias:
+ *   alias_build(n, w, prob, alias);                   // w[i] >= 0, prob and alias of n elements
+ *   int i = alias_draw(n, prob, alias, u1, u2);       // P(i) = w[i] / sum(w)
+ * A distance bin chosen this way is refined by linpdf_inverse() for the density linear within the bin.
+ *
+ * A cdftab inverts a cumulative distribution F tabulated at nodes x[0] < ... < x[n-1] from the density f linear
+ * between nodes, as getcumu2xist() does by a linear search. A guide table (Chen & Asau 1974) of nguide buckets of
+ * F gives the first segment that can contain F^-1(Freq), from which at most a few segments are stepped over when
+ * nguide is a few times n, and the quadratic of each segment is precomputed:
+ *   cdftab_init(&t, n, x, F, f, 4*n);
+ *   double xreq = cdftab_draw(&t, Freq);              // getcumu2xist(n, x, F, f, Freq, ist, 0) if F[0] < Freq <= F[n-1]
+ * Outside that range, where getcumu2xist() gives 0, Freq <= F[0] gives x[0] and Freq > F[n-1] gives x[n-1].
+ * For tables that cannot hold pointers (e.g. in shared memory), cdf_guide_build() fills the guide table alone into
+ * an array and cdf_draw() solves the quadratic of the segment found from x, F and f. */
+#include <math.h>
+
+typedef struct {
+  double a, b, c;          // a x^2 + b x + c = F(x) - F[i-1] + c for the segment from x[i-1] to x[i]
+  double x0, dxdF;         // x[i-1] and the inverse slope, used when a == 0
+} cdfseg;
+
+typedef struct {
+  int     n, nguide;
+  double  F0, F1, gscale;  // F[0], F[n-1], and Freq is in bucket (Freq - F0) * gscale
+  double  x0, x1;          // x[0], x[n-1]
+  int    *guide;           // guide[g]: first segment i (1 <= i < n) with F[i] >= F0 + g / gscale
+  double *F;               // F[0], ..., F[n-1]
+  cdfseg *seg;             // seg[i] for the segment from x[i-1] to x[i]
+} cdftab;
+
+void alias_build(int n, const double *w, double *prob, int *alias);
+void cdf_guide_build(int n, const double *F, int nguide, int *guide);
+void cdftab_init(cdftab *t, int n, const double *x, const double *F, const double *f, int nguide);
+void cdftab_free(cdftab *t);
+double getcumu2xist(int n, double *x, double *F, double *f, double Freq, int ist, int inv);
+
+static inline int alias_draw(int n, const double *prob, const int *alias, double u1, double u2)
+/* Item drawn from the alias table with uniform random numbers u1, u2 in [0, 1] */
+{
+  int k = u1 * n;
+  if (k >= n) k = n - 1;
+  return (u2 < prob[k]) ? k : alias[k];
+}
+
+static inline double linpdf_inverse(double f0, double f1, double u)
+/* Fraction t in [0, 1] of a bin where the integral of the density linear from f0 (t = 0) to f1 (t = 1) reaches
+ * u times its total, i.e., the root of (f1 - f0) t^2 / 2 + f0 t = u (f0 + f1) / 2 written without cancellation */
+{
+  if (f0 + f1 <= 0) return u;
+  return u * (f0 + f1) / (f0 + sqrt(f0 * f0 + u * (f1 * f1 - f0 * f0)));
+}
+
+static inline int cdf_segment(int n, const double *F, int i, double Freq)
+/* First segment i' >= i, i.e. from x[i'-1] to x[i'], with F[i'] >= Freq */
+{
+  while (i < n - 1 && F[i] < Freq) i++;
+  return i;
+}
+
+static inline double cdftab_draw(const cdftab *t, double Freq)
+/* x where F(x) = Freq, x[0] or x[n-1] for Freq outside F */
+{
+  if (Freq <= t->F0) return t->x0;
+  if (Freq >  t->F1) return t->x1;
+  int g = (Freq - t->F0) * t->gscale;
+  if (g >= t->nguide) g = t->nguide - 1;
+  int i = cdf_segment(t->n, t->F, t->guide[g], Freq);
+  const cdfseg *s = &t->seg[i];
+  double c = s->c - Freq;
+  return (s->a != 0) ? (-s->b + sqrt(s->b*s->b - 4*s->a*c)) * 0.5/s->a  // root of ax^2 +bx + c
+                     : s->x0 + s->dxdF * (Freq - t->F[i-1]);
+}
+
+static inline double cdf_draw(int n, const double *x, const double *F, const double *f, int nguide, const int *guide, double Freq)
+/* cdftab_draw() with the guide table made by cdf_guide_build() and the quadratic solved here */
+{
+  if (Freq <= F[0]) return x[0];
+  if (Freq >  F[n-1]) return x[n-1];
+  int g = (Freq - F[0]) / (F[n-1] - F[0]) * nguide;
+  if (g >= nguide) g = nguide - 1;
+  int i = cdf_segment(n, F, guide[g], Freq);
+  double a = 0.5*(f[i]-f[i-1])/(x[i]-x[i-1]);
+  double b = f[i-1] - 2*a*x[i-1];
+  double c = a*x[i-1]*x[i-1] - f[i-1]*x[i-1] + F[i-1] - Freq;
+  return (a != 0) ? (-b + sqrt(b*b - 4*a*c)) * 0.5/a
+                  : x[i-1] + (x[i]-x[i-1])/(F[i]-F[i-1])*(Freq-F[i-1]);
+}
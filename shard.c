@@ -0,0 +1,99 @@
+/* Counts of generated stars and shards of a run (see shard.h). */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "option.h"
+#include "shard.h"
+
+#define NCOUNT 24 // numbers in cellcount written to a manifest
+
+//----------------
+void cellcount_add(cellcount *sum, const cellcount *cnt)
+/* Add the counts of a grid to sum. Grids are added in their order so that the sums do not depend on how they are generated. */
+{
+  sum->allmass  += cnt->allmass;
+  sum->allstars += cnt->allstars;
+  sum->ncntall  += cnt->ncntall;
+  sum->ncnts    += cnt->ncnts;
+  sum->ncntbWD  += cnt->ncntbWD;
+  sum->ncntbCD  += cnt->ncntbCD;
+  for (int i=0; i<12; i++) sum->ncntcomp[i] += cnt->ncntcomp[i];
+  sum->nBD += cnt->nBD, sum->nMS += cnt->nMS, sum->nWD += cnt->nWD, sum->nNS += cnt->nNS, sum->nBH += cnt->nBH;
+  sum->nerror += cnt->nerror;
+  sum->nsimu  += cnt->nsimu;
+}
+//----------------
+void cellcount_print(FILE *fp, const cellcount *sum, int binary)
+/* Summary lines at the end of the output */
+{
+  fprintf (fp, "# sumM_MS/sumN_MS= %9.2f / %6.0f = %.6f Msun/*\n", sum->allmass, sum->allstars, sum->allmass/sum->allstars);
+  // fprintf (fp, "# sum.nerror= %d\n", sum->nerror);
+  if (binary == 1) fprintf (fp, "# (n_single n_binwide n_binclose)/n_all= ( %6.0f %6.0f %6.0f ) / %6.0f = ( %.6f %.6f %.6f )\n", sum->ncnts, sum->ncntbWD, sum->ncntbCD, sum->ncntall,sum->ncnts/sum->ncntall,sum->ncntbWD/sum->ncntall,sum->ncntbCD/sum->ncntall);
+  fprintf (fp, "# (n_thin1-7 n_thick n_bar n_nsd)/n_all= ( %6.0f %6.0f %6.0f %6.0f %6.0f %6.0f %6.0f %6.0f %6.0f %6.0f ) / %6.0f = ( %.6f %.6f %.6f %.6f %.6f %.6f %.6f %.6f %.6f %.6f )\n", sum->ncntcomp[0], sum->ncntcomp[1], sum->ncntcomp[2], sum->ncntcomp[3], sum->ncntcomp[4], sum->ncntcomp[5], sum->ncntcomp[6], sum->ncntcomp[7], sum->ncntcomp[8], sum->ncntcomp[9], sum->ncntall, sum->ncntcomp[0]/sum->ncntall, sum->ncntcomp[1]/sum->ncntall, sum->ncntcomp[2]/sum->ncntall, sum->ncntcomp[3]/sum->ncntall, sum->ncntcomp[4]/sum->ncntall, sum->ncntcomp[5]/sum->ncntall, sum->ncntcomp[6]/sum->ncntall, sum->ncntcomp[7]/sum->ncntall, sum->ncntcomp[8]/sum->ncntall, sum->ncntcomp[9]/sum->ncntall);
+  fprintf (fp, "# (n_BD n_MS n_WD n_NS n_BH)/n_all= ( %6.0f %6.0f %6.0f %6.0f %6.0f ) / %6.0f = ( %.6f %.6f %.6f %.6f %.6f )\n", sum->nBD, sum->nMS, sum->nWD, sum->nNS, sum->nBH,sum->ncntall, sum->nBD/sum->ncntall, sum->nMS/sum->ncntall, sum->nWD/sum->ncntall, sum->nNS/sum->ncntall, sum->nBH/sum->ncntall);
+}
+//----------------
+void shard_range(long n, int ishard, int nshard, long *i0, long *i1)
+/* Items [i0, i1) of n items processed by the ishard-th of nshard shards */
+{
+  *i0 = n * ishard / nshard;
+  *i1 = n * (ishard + 1) / nshard;
+}
+//----------------
+static void cellcount_pack(const cellcount *cnt, double *v)
+{
+  v[0] = cnt->allmass, v[1] = cnt->allstars, v[2] = cnt->ncntall, v[3] = cnt->ncnts, v[4] = cnt->ncntbWD, v[5] = cnt->ncntbCD;
+  for (int i=0; i<12; i++) v[6+i] = cnt->ncntcomp[i];
+  v[18] = cnt->nBD, v[19] = cnt->nMS, v[20] = cnt->nWD, v[21] = cnt->nNS, v[22] = cnt->nBH, v[23] = cnt->nerror;
+}
+//----------------
+static void cellcount_unpack(const double *v, cellcount *cnt)
+{
+  cnt->allmass = v[0], cnt->allstars = v[1], cnt->ncntall = v[2], cnt->ncnts = v[3], cnt->ncntbWD = v[4], cnt->ncntbCD = v[5];
+  for (int i=0; i<12; i++) cnt->ncntcomp[i] = v[6+i];
+  cnt->nBD = v[18], cnt->nMS = v[19], cnt->nWD = v[20], cnt->nNS = v[21], cnt->nBH = v[22], cnt->nerror = (int) v[23];
+}
+//----------------
+void shard_write_head(FILE *fp, int ishard, int nshard, long ngrid, long i0, long i1, long seed, int rng, int binary)
+{
+  fprintf(fp, SHARD_TAG "SHARD %d %d ngrid %ld grids %ld %ld seed %ld RNG %d BINARY %d\n", ishard, nshard, ngrid, i0, i1, seed, rng, binary);
+}
+//----------------
+void shard_write_grid(FILE *fp, long igrid, int il, int ib, unsigned long stream, const cellcount *cnt)
+{
+  double v[NCOUNT];
+  cellcount_pack(cnt, v);
+  fprintf(fp, SHARD_TAG "grid %ld %d %d %lu %ld", igrid, il, ib, stream, cnt->nsimu);
+  for (int i=0; i<NCOUNT; i++) fprintf(fp, " %.17g", v[i]);
+  fprintf(fp, "\n");
+}
+//----------------
+int shard_read_head(char *line, int *ishard, int *nshard, long *ngrid, long *i0, long *i1, long *seed, int *rng, int *binary)
+/* Parse a line written by shard_write_head(), return 0 on success. line is modified. */
+{
+  char *word[20];
+  if (strncmp(line, SHARD_TAG, strlen(SHARD_TAG)) != 0) return 1;
+  int n = tokenize(line + strlen(SHARD_TAG), word, 20);
+  if (n != 14 || strcmp(word[0], "SHARD") != 0 || strcmp(word[3], "ngrid") != 0 || strcmp(word[5], "grids") != 0
+      || strcmp(word[8], "seed") != 0 || strcmp(word[10], "RNG") != 0 || strcmp(word[12], "BINARY") != 0) return 1;
+  *ishard = atoi(word[1]), *nshard = atoi(word[2]);
+  *ngrid  = atol(word[4]), *i0 = atol(word[6]), *i1 = atol(word[7]);
+  *seed   = atol(word[9]), *rng = atoi(word[11]), *binary = atoi(word[13]);
+  return 0;
+}
+//----------------
+int shard_read_grid(char *line, long *igrid, int *il, int *ib, unsigned long *stream, cellcount *cnt)
+/* Parse a line written by shard_write_grid(), return 0 on success. line is modified. */
+{
+  char *word[NCOUNT+10];
+  double v[NCOUNT];
+  if (strncmp(line, SHARD_TAG, strlen(SHARD_TAG)) != 0) return 1;
+  int n = tokenize(line + strlen(SHARD_TAG), word, NCOUNT+10);
+  if (n != NCOUNT + 6 || strcmp(word[0], "grid") != 0) return 1;
+  *igrid  = atol(word[1]), *il = atoi(word[2]), *ib = atoi(word[3]);
+  *stream = strtoul(word[4], NULL, 10);
+  for (int i=0; i<NCOUNT; i++) v[i] = strtod(word[6+i], NULL);
+  cellcount_unpack(v, cnt);
+  cnt->nsimu = atol(word[5]);
+  return 0;
+}
@@ -0,0 +1,28 @@
+/* Counts of generated stars and splitting of a run into shards processed by independent genstars processes.
+ * With "SHARD i N" (0 <= i < N), genstars generates only the i-th of N contiguous blocks of the grids
+ * in the input area, in the order of grids of a single run. Every grid is seeded from the seed and its position
+ * only, so the grids are the same as in the single run. After its summary lines, each shard writes its manifest,
+ *   #@ SHARD i N ngrid <grids in the whole area> grids <first> <last+1> seed <seed> RNG <RNG> BINARY <BINARY>
+ *   #@ grid <index> <il> <ib> <stream> <NSIMU> <counts of the grid (cellcount, %.17g)>
+ * where <stream> is the counter word of Philox (RNG == 1) or the mt19937 seed (RNG == 0) of the grid.
+ * genmerge reads the outputs of all shards and writes the output of the single run with the summary lines
+ * recomputed from the counts of the grids. */
+#include <stdio.h>
+
+#define SHARD_TAG "#@ "
+
+typedef struct {
+  double allmass, allstars, ncntall, ncnts, ncntbWD, ncntbCD;
+  double ncntcomp[12];     // should be > ncomp. Prepare 12 just in case
+  double nBD, nMS, nWD, nNS, nBH;
+  int    nerror;
+  long   nsimu;
+} cellcount;
+
+void cellcount_add(cellcount *sum, const cellcount *cnt);
+void cellcount_print(FILE *fp, const cellcount *sum, int binary);
+void shard_range(long n, int ishard, int nshard, long *i0, long *i1);
+void shard_write_head(FILE *fp, int ishard, int nshard, long ngrid, long i0, long i1, long seed, int rng, int binary);
+void shard_write_grid(FILE *fp, long igrid, int il, int ib, unsigned long stream, const cellcount *cnt);
+int  shard_read_head(char *line, int *ishard, int *nshard, long *ngrid, long *i0, long *i1, long *seed, int *rng, int *binary);
+int  shard_read_grid(char *line, long *igrid, int *il, int *ib, unsigned long *stream, cellcount *cnt);
@@ -0,0 +1,229 @@
+/* Shared-memory segment of read-only tables (see shmtab.h). */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "shmtab.h"
+
+#define SHMTAB_HEAD ((sizeof(shmtab_header) + SHMTAB_ALIGN - 1) / SHMTAB_ALIGN * SHMTAB_ALIGN)
+#define SHMTAB_WAIT 600 // max seconds to wait for the creator when file locks are unavailable
+
+//----------------
+uint64_t shmtab_hash(uint64_t hash, const void *p, size_t n)
+/* 64-bit FNV-1a hash of n bytes at p, continued from hash (give 0 to start) */
+{
+  const unsigned char *c = p;
+  if (hash == 0) hash = 14695981039346656037ULL;
+  for (size_t i=0; i<n; i++){
+    hash ^= c[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+//----------------
+uint64_t shmtab_hash_file(uint64_t hash, const char *file)
+/* Hash the path, size and modification time of file */
+{
+  struct stat st;
+  int64_t stamp[2] = {-1, -1};
+  if (stat(file, &st) == 0) stamp[0] = st.st_size, stamp[1] = st.st_mtime;
+  hash = shmtab_hash(hash, file, strlen(file));
+  return shmtab_hash(hash, stamp, sizeof(stamp));
+}
+//----------------
+static int shmtab_fdopen(const shmtab *t, int flags, mode_t mode)
+{
+  return t->isfile ? open(t->name, flags, mode) : shm_open(t->name, flags, mode);
+}
+//----------------
+static void shmtab_unlink(const shmtab *t)
+{
+  if (t->isfile) unlink(t->name);
+  else           shm_unlink(t->name);
+}
+//----------------
+static int shmtab_isready(int fd)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t) SHMTAB_HEAD) return 0;
+  const shmtab_header *h = mmap(NULL, SHMTAB_HEAD, PROT_READ, MAP_SHARED, fd, 0);
+  if (h == MAP_FAILED) return 0;
+  int ready = __atomic_load_n(&h->ready, __ATOMIC_ACQUIRE);
+  munmap((void *) h, SHMTAB_HEAD);
+  return ready == 1;
+}
+//----------------
+static int shmtab_attach(shmtab *t)
+/* Map the segment made by another process after it is ready.
+ * Return 0 when attached, 1 when the segment was left unfinished by a dead creator, -1 on failure. */
+{
+  t->fd = shmtab_fdopen(t, O_RDONLY, 0);
+  if (t->fd < 0) return (errno == ENOENT) ? 1 : -1;
+  for (int iwait = 0; ; iwait++){
+    int locked = (flock(t->fd, LOCK_SH) == 0); // waits while the creator holds the exclusive lock
+    int ready  = shmtab_isready(t->fd);
+    if (locked) flock(t->fd, LOCK_UN);
+    if (ready) break;
+    // The lock is free but the segment is not ready: the creator is just starting, or has died
+    if ((locked && iwait >= 10) || iwait >= 100 * SHMTAB_WAIT){
+      close(t->fd);
+      return locked ? 1 : -1;
+    }
+    usleep(10000);
+  }
+  struct stat st;
+  if (fstat(t->fd, &st) != 0 || (t->h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, t->fd, 0)) == MAP_FAILED){
+    close(t->fd);
+    return -1;
+  }
+  t->size = st.st_size;
+  if (memcmp(t->h->magic, SHMTAB_MAGIC, 8) != 0 || t->h->version != SHMTAB_VERSION
+      || t->h->key != t->key || t->h->size != (int64_t) t->size){
+    munmap(t->h, t->size);
+    close(t->fd);
+    return 1;
+  }
+  return 0;
+}
+//----------------
+static shmtab *shmtab_create_or_attach(shmtab *t)
+{
+  for (int itry = 0; itry < 3; itry++){
+    t->fd = shmtab_fdopen(t, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (t->fd >= 0){
+      flock(t->fd, LOCK_EX);
+      t->creator = 1;
+      return t;
+    }
+    if (errno != EEXIST) break;
+    int stat = shmtab_attach(t);
+    if (stat == 0) return t;
+    if (stat < 0) break;
+    shmtab_unlink(t); // left unfinished by a dead creator, make it again
+  }
+  free(t);
+  return NULL;
+}
+//----------------
+shmtab *shmtab_open(const char *prefix, uint64_t key)
+/* Create the segment for key, or attach to it when another process has created it.
+ * Return NULL when shared memory is unavailable; the caller then builds its own tables. */
+{
+  shmtab *t = calloc(1, sizeof(shmtab));
+  t->key = key;
+  snprintf(t->name, sizeof(t->name), "/%s_%016llx", prefix, (unsigned long long) key);
+  return shmtab_create_or_attach(t);
+}
+//----------------
+shmtab *shmtab_open_file(const char *prefix, uint64_t key)
+/* Same as shmtab_open() with a regular file prefix_<key>.bin instead of a shared-memory segment,
+ * which keeps the tables across reboots. Return NULL when the file can't be made, e.g. in a read-only directory. */
+{
+  shmtab *t = calloc(1, sizeof(shmtab));
+  t->key = key;
+  t->isfile = 1;
+  snprintf(t->name, sizeof(t->name), "%s_%016llx.bin", prefix, (unsigned long long) key);
+  return shmtab_create_or_attach(t);
+}
+//----------------
+void *shmtab_reserve(shmtab *t, size_t size)
+/* Creator: give size bytes to the segment and return the memory for the data */
+{
+  t->size = SHMTAB_HEAD + size;
+  void *map = MAP_FAILED;
+  if (ftruncate(t->fd, t->size) == 0) map = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0);
+  if (map == MAP_FAILED){
+    printf("can't make the shared memory segment %s of %zu bytes\n",t->name,t->size);
+    shmtab_unlink(t);
+    exit(1);
+  }
+  t->h = map;
+  memcpy(t->h->magic, SHMTAB_MAGIC, 8);
+  t->h->version = SHMTAB_VERSION;
+  t->h->key = 0;
+  t->h->size = t->size;
+  return (char *) map + SHMTAB_HEAD;
+}
+//----------------
+void *shmtab_data(const shmtab *t, size_t *size)
+{
+  if (size != NULL) *size = t->size - SHMTAB_HEAD;
+  return (char *) t->h + SHMTAB_HEAD;
+}
+//----------------
+void shmtab_ready(shmtab *t)
+/* Creator: publish the stored tables to the other processes */
+{
+  t->h->key = t->key;
+  __atomic_store_n(&t->h->ready, 1, __ATOMIC_RELEASE);
+  flock(t->fd, LOCK_UN);
+}
+//----------------
+void shmtab_begin(shmtab *t)
+{
+  t->off = SHMTAB_HEAD;
+}
+//----------------
+void shmtab_table(shmtab *t, void *parray, size_t n)
+/* Replace the array *parray of n bytes by its copy in the segment */
+{
+  void **slot = parray;
+  size_t off = t->off;
+  t->off += (n + SHMTAB_ALIGN - 1) / SHMTAB_ALIGN * SHMTAB_ALIGN;
+  if (t->creator && t->pass == 0) return;
+  if (t->off > t->size){
+    printf("shared memory segment %s is smaller than the tables!\n",t->name);
+    exit(1);
+  }
+  if (t->creator) memcpy((char *) t->h + off, *slot, n);
+  if (t->nslot == t->maxslot){
+    t->maxslot = (t->maxslot == 0) ? 1024 : 2 * t->maxslot;
+    t->slots = realloc(t->slots, sizeof(void **) * t->maxslot);
+    t->origs = realloc(t->origs, sizeof(void *) * t->maxslot);
+  }
+  t->slots[t->nslot] = slot;
+  t->origs[t->nslot] = *slot;
+  t->nslot++;
+  *slot = (char *) t->h + off;
+}
+//----------------
+void shmtab_value(shmtab *t, void *p, size_t n)
+/* Copy n bytes at p to (creator) or from the segment */
+{
+  size_t off = t->off;
+  t->off += (n + SHMTAB_ALIGN - 1) / SHMTAB_ALIGN * SHMTAB_ALIGN;
+  if (t->creator && t->pass == 0) return;
+  if (t->off > t->size){
+    printf("shared memory segment %s is smaller than the tables!\n",t->name);
+    exit(1);
+  }
+  if (t->creator) memcpy((char *) t->h + off, p, n);
+  else            memcpy(p, (char *) t->h + off, n);
+}
+//----------------
+int shmtab_end(shmtab *t)
+/* Return 1 when the tables have to be registered once more */
+{
+  if (t->creator && t->pass == 0){
+    shmtab_reserve(t, t->off - SHMTAB_HEAD);
+    t->pass = 1;
+    return 1;
+  }
+  if (t->creator) shmtab_ready(t);
+  return 0;
+}
+//----------------
+void shmtab_close(shmtab *t)
+{
+  for (int i=0; i<t->nslot; i++) *t->slots[i] = t->origs[i];
+  if (t->h != NULL && t->h != MAP_FAILED) munmap(t->h, t->size);
+  close(t->fd);
+  free(t->slots);
+  free(t->origs);
+  free(t);
+}
@@ -0,0 +1,59 @@
+/* Named POSIX shared-memory segment of read-only tables, shared by genstars processes running side by side.
+ * A segment is named after a hash of everything its tables depend on, e.g. /genstars_0123456789abcdef.
+ * The first process creates it, builds the tables as usual and copies them into the segment.
+ * Processes started later with the same key wait until the segment is ready and use the tables in it
+ * instead of building them. Segments remain after the processes exit so that later runs can attach;
+ * remove them with "rm /dev/shm/genstars_*" on Linux.
+ *
+ * The tables are registered in the same order by the creator and by the attaching processes:
+ *   do {
+ *     shmtab_begin(t);
+ *     shmtab_table(t, &array, nbytes);  // array is copied to (creator) or taken from the segment
+ *     shmtab_value(t, &value, nbytes);  // value is copied to (creator) or from the segment
+ *     ...
+ *   } while (shmtab_end(t));            // the creator goes twice, first to count the size
+ * Arrays replaced by segment memory are given back by shmtab_close(), so they can be freed as before.
+ * shmtab_open_file() does the same with a regular file, e.g. input_files/ShuDF_0123456789abcdef.bin,
+ * so that the tables are kept as a cache for later runs; loading them is a single mmap. */
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHMTAB_MAGIC   "GSSHMTAB"
+#define SHMTAB_VERSION 4 // increased when the layout of the tables changes
+#define SHMTAB_ALIGN   64
+
+typedef struct {
+  char     magic[8];
+  int32_t  version;
+  int32_t  ready;          // set to 1 by the creator after the tables are stored
+  uint64_t key;
+  int64_t  size;           // segment size including this header
+} shmtab_header;
+
+typedef struct {
+  char   name[256];
+  uint64_t key;
+  int    fd;
+  int    isfile;           // 1 for a regular file made by shmtab_open_file()
+  int    creator;          // 1 if this process builds and stores the tables
+  int    pass;             // creator: 0 while counting the size, 1 while storing
+  shmtab_header *h;
+  size_t size;             // mapped size
+  size_t off;              // offset of the next table
+  int    nslot, maxslot;   // array pointers replaced by shmtab_table()
+  void ***slots;
+  void  **origs;
+} shmtab;
+
+uint64_t shmtab_hash(uint64_t hash, const void *p, size_t n);
+uint64_t shmtab_hash_file(uint64_t hash, const char *file);
+shmtab *shmtab_open(const char *prefix, uint64_t key);
+shmtab *shmtab_open_file(const char *prefix, uint64_t key);
+void   *shmtab_reserve(shmtab *t, size_t size);
+void   *shmtab_data(const shmtab *t, size_t *size);
+void    shmtab_ready(shmtab *t);
+void    shmtab_begin(shmtab *t);
+void    shmtab_table(shmtab *t, void *parray, size_t n);
+void    shmtab_value(shmtab *t, void *p, size_t n);
+int     shmtab_end(shmtab *t);
+void    shmtab_close(shmtab *t);
@@ -0,0 +1,96 @@
+/* exp() and log() written for loops vectorized by the compiler.
+ * Unlike those of libm, which are calls the compiler cannot vectorize, vexp() and vlog() are inline
+ * straight-line code without branches or tables, so a loop of them becomes SIMD code (AVX2, AVX-512, ...)
+ * of the target. Results are within 2 ulp of the exact values (vpow() within about |y log x| ulp) and the same
+ * with any SIMD width, as long as floating-point contraction (FMA) is off (-ffp-contract=off). GCC vectorizes
+ * their loops with -fno-trapping-math, as given in the Makefile.
+ * VMATH_CLONES before a function makes the compiler build it for AVX-512, AVX2 and the default target,
+ * and pick one at load time for the CPU. */
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(NO_TARGET_CLONES) \
+    && ((defined(__clang__) && __clang_major__ >= 14) || (!defined(__clang__) && defined(__GNUC__) && __GNUC__ >= 6))
+#define VMATH_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define VMATH_CLONES
+#endif
+
+// Always inlined, since a call in a loop keeps it from being vectorized
+#if defined(__GNUC__)
+#define VMATH_INLINE static inline __attribute__((always_inline))
+#else
+#define VMATH_INLINE static inline
+#endif
+
+#define VMATH_SHIFT 6755399441055744.0 // 1.5*2^52, adding it rounds to an integer kept in the low bits
+
+VMATH_INLINE double vmath_d(uint64_t u){ double x; memcpy(&x, &u, 8); return x; }
+VMATH_INLINE uint64_t vmath_u(double x){ uint64_t u; memcpy(&u, &x, 8); return u; }
+
+VMATH_INLINE double vexp(double x)
+/* exp(x), 0 for x < -745.2 (including -inf), inf for x > 709.79 */
+{
+  double xc = (x < -746.0) ? -746.0 : (x > 710.0) ? 710.0 : x;
+  double kd = xc * 1.4426950408889634 + VMATH_SHIFT;
+  double n  = kd - VMATH_SHIFT; // nearest integer of x/ln2
+  double r  = (xc - n * 6.93147180369123816490e-01) - n * 1.90821492927058770002e-10; // |r| <= ln2/2
+  // Taylor series to r^13, whose truncation error is below 1e-17
+  double p = 1.0/6227020800.0;
+  p = p * r + 1.0/479001600.0;
+  p = p * r + 1.0/39916800.0;
+  p = p * r + 1.0/3628800.0;
+  p = p * r + 1.0/362880.0;
+  p = p * r + 1.0/40320.0;
+  p = p * r + 1.0/5040.0;
+  p = p * r + 1.0/720.0;
+  p = p * r + 1.0/120.0;
+  p = p * r + 1.0/24.0;
+  p = p * r + 1.0/6.0;
+  p = p * r + 0.5;
+  p = p * r + 1.0;
+  p = p * r + 1.0;
+  // 2^n, split into 2^(n-+600) * 2^+-600 beyond +-700 so that the exponent field does not overflow
+  double bias = (xc < -700.0) ? 1623.0 : 1023.0, sc = (xc < -700.0) ? 0x1p-600 : 1.0;
+  bias = (xc > 700.0) ? 423.0 : bias;
+  sc   = (xc > 700.0) ? 0x1p600 : sc;
+  double s  = vmath_d(vmath_u(n + bias + VMATH_SHIFT) << 52);
+  return p * s * sc; // 0 below -745.2 and inf above 709.79 by rounding
+}
+
+VMATH_INLINE double vlog(double x)
+/* log(x) for x >= 0, -inf for x == 0 */
+{
+  // subnormal numbers are scaled by 2^54 first
+  double xs = x * ((x < 0x1p-1022) ? 0x1p54 : 1.0);
+  double eb = (x < 0x1p-1022) ? 0x1p52 + 1023.0 + 54.0 : 0x1p52 + 1023.0;
+  uint64_t u = vmath_u(xs);
+  double e = vmath_d(0x4330000000000000ULL | (u >> 52)) - eb;
+  double m = vmath_d((u & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL); // 1 <= m < 2
+  e = e + ((m > 1.4142135623730951) ? 1.0 : 0.0);
+  m = m * ((m > 1.4142135623730951) ? 0.5 : 1.0);
+  // log(m) = 2 atanh(f) with |f| <= 0.172, series to f^23, whose truncation error is below 1e-17
+  double f = (m - 1.0) / (m + 1.0);
+  double s = f * f;
+  double p = 1.0/23;
+  p = p * s + 1.0/21;
+  p = p * s + 1.0/19;
+  p = p * s + 1.0/17;
+  p = p * s + 1.0/15;
+  p = p * s + 1.0/13;
+  p = p * s + 1.0/11;
+  p = p * s + 1.0/9;
+  p = p * s + 1.0/7;
+  p = p * s + 1.0/5;
+  p = p * s + 1.0/3;
+  double lm = 2.0 * f + 2.0 * f * s * p;
+  double y  = e * 6.93147180369123816490e-01 + (lm + e * 1.90821492927058770002e-10);
+  return y + ((x == 0.0) ? -HUGE_VAL : 0.0);
+}
+
+VMATH_INLINE double vpow(double x, double y)
+/* pow(x, y) for x >= 0 and y > 0 */
+{
+  return vexp(y * vlog(x));
+}